@@ -0,0 +1,195 @@
+#include <cstring>
+
+#include "fp16.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define W2X_X86 1
+#include <immintrin.h>
+#include "ncnn/cpu.h"
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define W2X_AARCH64 1
+#include <arm_neon.h>
+#endif
+
+#if W2X_X86 && (defined(__GNUC__) || defined(__clang__))
+#define W2X_TARGET_F16C __attribute__((target("avx,f16c")))
+#else
+#define W2X_TARGET_F16C
+#endif
+
+static inline uint32_t as_uint(const float f) noexcept
+{
+    uint32_t u;
+    std::memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+static inline float as_float(const uint32_t u) noexcept
+{
+    float f;
+    std::memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+static inline uint16_t float_to_half_1(const float f) noexcept
+{
+    constexpr uint32_t f32infty = 255u << 23;
+    constexpr uint32_t f16max = (127u + 16u) << 23;
+    constexpr uint32_t denorm_magic = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+
+    uint32_t u = as_uint(f);
+    const uint32_t sign = u & 0x80000000u;
+    u ^= sign;
+
+    uint16_t o;
+
+    if (u >= f16max)
+    {
+        // inf or nan, overflow goes to inf
+        o = (u > f32infty) ? 0x7e00 : 0x7c00;
+    }
+    else if (u < (113u << 23))
+    {
+        // subnormal or zero, the addition does the rounding
+        o = static_cast<uint16_t>(as_uint(as_float(u) + as_float(denorm_magic)) - denorm_magic);
+    }
+    else
+    {
+        const uint32_t mant_odd = (u >> 13) & 1;
+
+        u -= (127u - 15u) << 23;
+        u += 0xfff + mant_odd;
+        o = static_cast<uint16_t>(u >> 13);
+    }
+
+    return static_cast<uint16_t>(o | (sign >> 16));
+}
+
+static inline float half_to_float_1(const uint16_t h) noexcept
+{
+    constexpr uint32_t shifted_exp = 0x7c00u << 13;
+    constexpr float magic = 6.103515625e-05f; // 2^-14
+
+    uint32_t o = (h & 0x7fffu) << 13;
+    const uint32_t exp = shifted_exp & o;
+    o += (127u - 15u) << 23;
+
+    if (exp == shifted_exp)
+    {
+        // inf or nan
+        o += (128u - 16u) << 23;
+    }
+    else if (exp == 0)
+    {
+        // subnormal or zero
+        o += 1u << 23;
+        o = as_uint(as_float(o) - magic);
+    }
+
+    return as_float(o | ((h & 0x8000u) << 16));
+}
+
+void float_to_half_c(const float* src, uint16_t* dst, size_t n) noexcept
+{
+    for (size_t i = 0; i < n; ++i)
+        dst[i] = float_to_half_1(src[i]);
+}
+
+void half_to_float_c(const uint16_t* src, float* dst, size_t n) noexcept
+{
+    for (size_t i = 0; i < n; ++i)
+        dst[i] = half_to_float_1(src[i]);
+}
+
+#if W2X_X86
+W2X_TARGET_F16C static void float_to_half_f16c(const float* src, uint16_t* dst, size_t n) noexcept
+{
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m128i h0 = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+        const __m128i h1 = _mm256_cvtps_ph(_mm256_loadu_ps(src + i + 8), _MM_FROUND_TO_NEAREST_INT);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), h0);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 8), h1);
+    }
+
+    for (; i + 8 <= n; i += 8)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+
+    float_to_half_c(src + i, dst + i, n - i);
+}
+
+W2X_TARGET_F16C static void half_to_float_f16c(const uint16_t* src, float* dst, size_t n) noexcept
+{
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m256 f0 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+        const __m256 f1 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 8)));
+
+        _mm256_storeu_ps(dst + i, f0);
+        _mm256_storeu_ps(dst + i + 8, f1);
+    }
+
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))));
+
+    half_to_float_c(src + i, dst + i, n - i);
+}
+
+static const bool has_f16c = ncnn::cpu_support_x86_avx() && ncnn::cpu_support_x86_f16c();
+#endif
+
+#if W2X_AARCH64
+static void float_to_half_neon(const float* src, uint16_t* dst, size_t n) noexcept
+{
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        const float16x8_t h = vcombine_f16(vcvt_f16_f32(vld1q_f32(src + i)), vcvt_f16_f32(vld1q_f32(src + i + 4)));
+        vst1q_u16(dst + i, vreinterpretq_u16_f16(h));
+    }
+
+    float_to_half_c(src + i, dst + i, n - i);
+}
+
+static void half_to_float_neon(const uint16_t* src, float* dst, size_t n) noexcept
+{
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        const float16x8_t h = vreinterpretq_f16_u16(vld1q_u16(src + i));
+        vst1q_f32(dst + i, vcvt_f32_f16(vget_low_f16(h)));
+        vst1q_f32(dst + i + 4, vcvt_f32_f16(vget_high_f16(h)));
+    }
+
+    half_to_float_c(src + i, dst + i, n - i);
+}
+#endif
+
+void float_to_half(const float* src, uint16_t* dst, size_t n) noexcept
+{
+#if W2X_X86
+    if (has_f16c)
+        return float_to_half_f16c(src, dst, n);
+#elif W2X_AARCH64
+    return float_to_half_neon(src, dst, n);
+#endif
+    float_to_half_c(src, dst, n);
+}
+
+void half_to_float(const uint16_t* src, float* dst, size_t n) noexcept
+{
+#if W2X_X86
+    if (has_f16c)
+        return half_to_float_f16c(src, dst, n);
+#elif W2X_AARCH64
+    return half_to_float_neon(src, dst, n);
+#endif
+    half_to_float_c(src, dst, n);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// float <-> IEEE half precision conversion of the host copies, round to nearest even
+// uses F16C on x86 when the CPU has it and NEON on aarch64, scalar code otherwise
+
+void float_to_half(const float* src, uint16_t* dst, size_t n) noexcept;
+void half_to_float(const uint16_t* src, float* dst, size_t n) noexcept;
+
+// scalar versions, also used for the tails of the SIMD versions
+void float_to_half_c(const float* src, uint16_t* dst, size_t n) noexcept;
+void half_to_float_c(const uint16_t* src, float* dst, size_t n) noexcept;
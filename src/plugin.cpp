@@ -24,11 +24,25 @@
 */
 
 #include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <list>
+#include <map>
 #include <memory>
-#include <semaphore>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "avisynth_c.h"
@@ -37,46 +51,727 @@
 
 using namespace std::literals;
 
-static std::atomic<int> numGPUInstances{ 0 };
+// the Vulkan instance is shared by all the filters, the first one creates it and the last one destroys it,
+// the devices are initialized on the first frame or the warm-up thread, so the count and the instance change together under the lock
+static std::mutex gpuInstanceMutex;
+static int numGPUInstances;
+
+static bool acquire_gpu_instance() noexcept
+{
+    std::lock_guard<std::mutex> lock(gpuInstanceMutex);
+
+    if (ncnn::create_gpu_instance())
+        return false;
+
+    ++numGPUInstances;
+    return true;
+}
+
+static void release_gpu_instance() noexcept
+{
+    std::lock_guard<std::mutex> lock(gpuInstanceMutex);
+
+    if (--numGPUInstances == 0)
+        ncnn::destroy_gpu_instance();
+}
+
+// tile sizes picked by the auto-tuner, per device, model and clip
+static std::mutex tunedTilesMutex;
+static std::map<std::string, std::pair<int, int>> tunedTiles;
+
+static constexpr int planesRgb[4]{ AVS_PLANAR_R, AVS_PLANAR_G, AVS_PLANAR_B, AVS_PLANAR_A };
+static constexpr int planesYuv[3]{ AVS_PLANAR_Y, AVS_PLANAR_U, AVS_PLANAR_V };
+
+// the per-frame timings of stats=true, in the order of FrameStats, attached as _W2X_<name>Ms
+static constexpr const char* statNames[]{ "Upload", "Record", "Gpu", "Download", "Preproc", "Infer", "Postproc", "Wait", "Total" };
+using FrameStats = std::array<double, std::size(statNames)>;
+
+// one upscaler per device shared by all the threads, gpu_thread frames can run on it at the same time
+struct Device
+{
+    std::unique_ptr<Waifu2x> waifu2x;
+    int capacity;
+    int busy;
+    double frameTime; // moving average of the seconds per frame, 0 until measured
+};
+
+// a processed frame kept for dedup, with its source for the near-duplicate comparison
+struct Duplicate
+{
+    uint64_t hash;
+    AVS_VideoFrame* src;
+    AVS_VideoFrame* dst;
+};
 
 struct w2xncnnvk
 {
     AVS_FilterInfo* fi;
-    std::unique_ptr<Waifu2x> waifu2x;
-    std::unique_ptr<std::counting_semaphore<>> semaphore;
     std::string msg;
+    bool gpuInstance;
+
+    // the frames go to the device expected to finish them first
+    std::vector<Device> devices;
+    std::mutex deviceMutex;
+    std::condition_variable deviceCv;
+
+    // stats=true
+    bool collectStats;
+    std::mutex statsMutex;
+    std::vector<FrameStats> frameStats;
+    int64_t tiles;
+    int64_t reusedTiles;
+
+    // outputs of the last dedup source frames, most recently used first
+    int dedup;
+    float dedupThresh;
+    std::mutex dedupMutex;
+    std::list<Duplicate> duplicates;
+    int64_t dedupFrames;
+    int64_t duplicateFrames;
+
+    int batch;
+    int prefetch;
+
+    // finished frames, filled by the batches and by the lookahead worker
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::map<int, AVS_VideoFrame*> cache;
+    int last{ -2 };
+    int ahead{ -1 };
+    std::set<int> inFlight;
+    bool stop;
+    std::vector<std::thread> workers;
+
+    // the GPU instance, the devices and the models are created by the first frame or by the warm-up thread,
+    // init does it and is cleared afterwards, msg holds its error, cancel stops it between the stages when the filter is freed
+    std::mutex initMutex;
+    std::function<void()> init;
+    std::atomic<bool> initialized;
+    std::atomic<bool> cancel;
+    bool warmup;
+    std::thread warmupThread;
+    double loadTime; // ms spent loading the models and creating the pipelines
 };
 
-static void filter(const AVS_VideoFrame* src, AVS_VideoFrame* dst, const w2xncnnvk* const __restrict d) noexcept
+static void filter(AVS_VideoFrame* const* src, AVS_VideoFrame* const* dst, const int count, w2xncnnvk* const __restrict d) noexcept
+{
+    const int* planes{ avs_is_rgb(&d->fi->vi) ? planesRgb : planesYuv };
+    const auto size{ avs_component_size(&d->fi->vi) };
+
+    const auto width{ avs_get_row_size_p(src[0], planes[0]) / size };
+    const auto height{ avs_get_height_p(src[0], planes[0]) };
+
+    const auto numPlanes{ avs_num_components(&d->fi->vi) };
+
+    std::vector<Waifu2x::Frame> frames(count);
+
+    for (auto i{ 0 }; i < count; ++i)
+    {
+        for (auto p{ 0 }; p < numPlanes; ++p)
+        {
+            frames[i].srcStride[p] = avs_get_pitch_p(src[i], planes[p]) / size;
+            frames[i].dstStride[p] = avs_get_pitch_p(dst[i], planes[p]) / size;
+            frames[i].src[p] = avs_get_read_ptr_p(src[i], planes[p]);
+            frames[i].dst[p] = avs_get_write_ptr_p(dst[i], planes[p]);
+        }
+    }
+
+    size_t dev{};
+    const auto waitStart{ std::chrono::steady_clock::now() };
+
+    {
+        std::unique_lock<std::mutex> lock(d->deviceMutex);
+
+        while (true)
+        {
+            // devices that haven't been measured yet are tried first
+            auto best{ -1.0 };
+
+            for (size_t i{ 0 }; i < d->devices.size(); ++i)
+            {
+                const auto& device{ d->devices[i] };
+                if (device.busy >= device.capacity)
+                    continue;
+
+                const auto finish{ (device.busy + 1) * device.frameTime / device.capacity };
+                if (best < 0.0 || finish < best)
+                {
+                    best = finish;
+                    dev = i;
+                }
+            }
+
+            if (best >= 0.0)
+                break;
+
+            d->deviceCv.wait(lock);
+        }
+
+        ++d->devices[dev].busy;
+    }
+
+    Waifu2x::Stats stats{};
+
+    const auto start{ std::chrono::steady_clock::now() };
+    d->devices[dev].waifu2x->process(frames.data(), count, width, height, d->collectStats ? &stats : nullptr);
+    const auto end{ std::chrono::steady_clock::now() };
+    const auto time{ std::chrono::duration<double>(end - start).count() / count };
+
+    {
+        std::lock_guard<std::mutex> lock(d->deviceMutex);
+
+        auto& device{ d->devices[dev] };
+        device.frameTime = (device.frameTime > 0.0) ? device.frameTime * 0.8 + time * 0.2 : time;
+        --device.busy;
+    }
+    d->deviceCv.notify_all();
+
+    if (d->collectStats)
+    {
+        // the stages of a batch are shared evenly by its frames
+        const FrameStats frameStats{ stats.upload / count, stats.record / count, stats.gpu / count, stats.download / count, stats.preproc / count, stats.infer / count,
+            stats.postproc / count, std::chrono::duration<double, std::milli>(start - waitStart).count(),
+            std::chrono::duration<double, std::milli>(start - waitStart).count() + std::chrono::duration<double, std::milli>(end - start).count() / count };
+
+        for (auto i{ 0 }; i < count; ++i)
+        {
+            auto props{ avs_get_frame_props_rw(d->fi->env, dst[i]) };
+
+            for (size_t j{ 0 }; j < frameStats.size(); ++j)
+                avs_prop_set_float(d->fi->env, props, ("_W2X_"s + statNames[j] + "Ms").c_str(), frameStats[j], AVS_PROPAPPENDMODE_REPLACE);
+
+            avs_prop_set_int(d->fi->env, props, "_W2X_Device", static_cast<int64_t>(dev), AVS_PROPAPPENDMODE_REPLACE);
+            avs_prop_set_int(d->fi->env, props, "_W2X_BatchSize", count, AVS_PROPAPPENDMODE_REPLACE);
+            avs_prop_set_float(d->fi->env, props, "_W2X_TileReuse", (stats.tiles > 0) ? static_cast<double>(stats.reused) / stats.tiles : 0.0, AVS_PROPAPPENDMODE_REPLACE);
+            avs_prop_set_float(d->fi->env, props, "_W2X_PeakVramMiB", stats.memory / 1048576.0, AVS_PROPAPPENDMODE_REPLACE);
+            avs_prop_set_float(d->fi->env, props, "_W2X_LoadMs", d->loadTime, AVS_PROPAPPENDMODE_REPLACE);
+        }
+
+        std::lock_guard<std::mutex> lock(d->statsMutex);
+        d->frameStats.insert(d->frameStats.end(), count, frameStats);
+        d->tiles += stats.tiles;
+        d->reusedTiles += stats.reused;
+    }
+}
+
+// aggregate of the per-frame timings, printed when the filter is freed
+static void report_stats(const w2xncnnvk* d) noexcept
+{
+    if (d->frameStats.empty())
+        return;
+
+    std::string report{ "w2xncnnvk stats, " + std::to_string(d->frameStats.size()) + " frames, " + std::to_string(d->devices.size()) + " device(s), " +
+        std::to_string(d->loadTime) + " ms loading\n" };
+    report += "stage          mean      p50      p90      p99      max  (ms per frame)\n";
+
+    std::vector<double> values(d->frameStats.size());
+
+    for (size_t j{ 0 }; j < std::size(statNames); ++j)
+    {
+        for (size_t i{ 0 }; i < values.size(); ++i)
+            values[i] = d->frameStats[i][j];
+
+        std::sort(values.begin(), values.end());
+
+        double sum{};
+        for (const auto v : values)
+            sum += v;
+
+        const auto percentile{ [&](const double p) { return values[static_cast<size_t>(p * (values.size() - 1) + 0.5)]; } };
+
+        char line[128];
+        std::snprintf(line, sizeof(line), "%-10s %8.2f %8.2f %8.2f %8.2f %8.2f\n", statNames[j], sum / values.size(), percentile(0.5), percentile(0.9), percentile(0.99), values.back());
+        report += line;
+    }
+
+    for (size_t i{ 0 }; i < d->devices.size(); ++i)
+    {
+        report += "device " + std::to_string(i) + ": " + std::to_string(d->devices[i].frameTime * 1000.0) + " ms per frame (moving average)";
+
+        if (const auto peak{ d->devices[i].waifu2x->peak_memory() }; peak > 0)
+            report += ", peak VRAM of the blobs " + std::to_string(peak >> 20) + " MiB";
+
+        report += "\n";
+    }
+
+    if (d->dedup > 0 && d->dedupFrames > 0)
+        report += "dedup: " + std::to_string(d->duplicateFrames) + " of " + std::to_string(d->dedupFrames) + " frames reused (" + std::to_string(d->duplicateFrames * 100 / d->dedupFrames) + "%)\n";
+
+    if (d->devices[0].waifu2x->tile_cache_size > 0 && d->tiles > 0)
+        report += "tile cache: " + std::to_string(d->reusedTiles) + " of " + std::to_string(d->tiles) + " tiles reused (" + std::to_string(d->reusedTiles * 100 / d->tiles) + "%)\n";
+
+    std::fputs(report.c_str(), stderr);
+#ifdef _WIN32
+    OutputDebugStringA(report.c_str());
+#endif
+}
+
+// hash of the planes, four independent lanes so that the multiplies of a row overlap
+static uint64_t hash_frame(const w2xncnnvk* d, const AVS_VideoFrame* frame) noexcept
+{
+    constexpr uint64_t k{ 0x9e3779b97f4a7c15ull };
+
+    const int* planes{ avs_is_rgb(&d->fi->vi) ? planesRgb : planesYuv };
+    uint64_t lanes[4]{ 1, 2, 3, 4 };
+
+    for (auto p{ 0 }; p < avs_num_components(&d->fi->vi); ++p)
+    {
+        const auto ptr{ avs_get_read_ptr_p(frame, planes[p]) };
+        const auto pitch{ avs_get_pitch_p(frame, planes[p]) };
+        const auto rowSize{ avs_get_row_size_p(frame, planes[p]) };
+        const auto height{ avs_get_height_p(frame, planes[p]) };
+
+        for (auto y{ 0 }; y < height; ++y)
+        {
+            const auto row{ ptr + static_cast<ptrdiff_t>(y) * pitch };
+            auto x{ 0 };
+
+            for (; x + 32 <= rowSize; x += 32)
+            {
+                for (auto l{ 0 }; l < 4; ++l)
+                {
+                    uint64_t v;
+                    std::memcpy(&v, row + x + l * 8, sizeof(v));
+
+                    lanes[l] = (lanes[l] ^ v) * k;
+                    lanes[l] ^= lanes[l] >> 29;
+                }
+            }
+
+            for (; x < rowSize; ++x)
+            {
+                lanes[0] = (lanes[0] ^ row[x]) * k;
+                lanes[0] ^= lanes[0] >> 29;
+            }
+        }
+    }
+
+    uint64_t hash{};
+    for (const auto lane : lanes)
+    {
+        hash = (hash ^ lane) * k;
+        hash ^= hash >> 29;
+    }
+
+    return hash;
+}
+
+// true when the mean absolute difference of the planes is at most dedup_thresh (in 8-bit steps)
+template<typename T>
+static bool near_duplicate(const w2xncnnvk* d, const AVS_VideoFrame* a, const AVS_VideoFrame* b, const double scale) noexcept
+{
+    const int* planes{ avs_is_rgb(&d->fi->vi) ? planesRgb : planesYuv };
+
+    const auto numPlanes{ avs_num_components(&d->fi->vi) };
+
+    int64_t samples{};
+    for (auto p{ 0 }; p < numPlanes; ++p)
+        samples += static_cast<int64_t>(avs_get_row_size_p(a, planes[p]) / sizeof(T)) * avs_get_height_p(a, planes[p]);
+
+    // gives up as soon as the sum is over the limit
+    const auto limit{ d->dedupThresh * scale * samples };
+    double sum{};
+
+    for (auto p{ 0 }; p < numPlanes; ++p)
+    {
+        const auto width{ avs_get_row_size_p(a, planes[p]) / static_cast<int>(sizeof(T)) };
+        const auto height{ avs_get_height_p(a, planes[p]) };
+
+        for (auto y{ 0 }; y < height; ++y)
+        {
+            const auto rowA{ reinterpret_cast<const T*>(avs_get_read_ptr_p(a, planes[p]) + static_cast<ptrdiff_t>(y) * avs_get_pitch_p(a, planes[p])) };
+            const auto rowB{ reinterpret_cast<const T*>(avs_get_read_ptr_p(b, planes[p]) + static_cast<ptrdiff_t>(y) * avs_get_pitch_p(b, planes[p])) };
+
+            double rowSum{};
+            for (auto x{ 0 }; x < width; ++x)
+                rowSum += std::abs(static_cast<double>(rowA[x]) - static_cast<double>(rowB[x]));
+
+            sum += rowSum;
+            if (sum > limit)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// true when the planes are identical, a hash match alone can be a collision
+static bool same_frame(const w2xncnnvk* d, const AVS_VideoFrame* a, const AVS_VideoFrame* b) noexcept
+{
+    const int* planes{ avs_is_rgb(&d->fi->vi) ? planesRgb : planesYuv };
+
+    for (auto p{ 0 }; p < avs_num_components(&d->fi->vi); ++p)
+    {
+        const auto rowSize{ avs_get_row_size_p(a, planes[p]) };
+        const auto height{ avs_get_height_p(a, planes[p]) };
+
+        for (auto y{ 0 }; y < height; ++y)
+        {
+            if (std::memcmp(avs_get_read_ptr_p(a, planes[p]) + static_cast<ptrdiff_t>(y) * avs_get_pitch_p(a, planes[p]),
+                avs_get_read_ptr_p(b, planes[p]) + static_cast<ptrdiff_t>(y) * avs_get_pitch_p(b, planes[p]), rowSize))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// near_duplicate with the sample type of the clip
+static bool near_frame(const w2xncnnvk* d, const AVS_VideoFrame* a, const AVS_VideoFrame* b) noexcept
+{
+    const auto size{ avs_component_size(&d->fi->vi) };
+    const auto bits{ avs_bits_per_component(&d->fi->vi) };
+
+    return (size == 1) ? near_duplicate<uint8_t>(d, a, b, 1.0) :
+        (size == 2) ? near_duplicate<uint16_t>(d, a, b, static_cast<double>(1 << (bits - 8))) :
+        near_duplicate<float>(d, a, b, 1.0 / 255.0);
+}
+
+// copies the planes of src into dst, dst keeps the properties of its own source
+static void copy_planes(const w2xncnnvk* d, AVS_VideoFrame* dst, const AVS_VideoFrame* src) noexcept
 {
-    const auto width{ avs_get_row_size_p(src, AVS_PLANAR_B) / avs_component_size(&d->fi->vi) };
-    const auto height{ avs_get_height_p(src, AVS_PLANAR_B) };
-    const auto srcStride{ avs_get_pitch_p(src, AVS_PLANAR_B) / avs_component_size(&d->fi->vi) };
-    const auto dstStride{ avs_get_pitch_p(dst, AVS_PLANAR_B) / avs_component_size(&d->fi->vi) };
-    const auto srcR{ reinterpret_cast<const float*>(avs_get_read_ptr_p(src, AVS_PLANAR_R)) };
-    const auto srcG{ reinterpret_cast<const float*>(avs_get_read_ptr_p(src, AVS_PLANAR_G)) };
-    const auto srcB{ reinterpret_cast<const float*>(avs_get_read_ptr_p(src, AVS_PLANAR_B)) };
-    auto dstR{ reinterpret_cast<float*>(avs_get_write_ptr_p(dst, AVS_PLANAR_R)) };
-    auto dstG{ reinterpret_cast<float*>(avs_get_write_ptr_p(dst, AVS_PLANAR_G)) };
-    auto dstB{ reinterpret_cast<float*>(avs_get_write_ptr_p(dst, AVS_PLANAR_B)) };
-
-    d->semaphore->acquire();
-    d->waifu2x->process(srcR, srcG, srcB, dstR, dstG, dstB, width, height, srcStride, dstStride);
-    d->semaphore->release();
+    const int* planes{ avs_is_rgb(&d->fi->vi) ? planesRgb : planesYuv };
+
+    for (auto p{ 0 }; p < avs_num_components(&d->fi->vi); ++p)
+        avs_bit_blt(d->fi->env, avs_get_write_ptr_p(dst, planes[p]), avs_get_pitch_p(dst, planes[p]), avs_get_read_ptr_p(src, planes[p]), avs_get_pitch_p(src, planes[p]),
+            avs_get_row_size_p(src, planes[p]), avs_get_height_p(src, planes[p]));
+}
+
+// fills dst with the output of an earlier frame with the same (or nearly the same) source, false when there is none
+static bool find_duplicate(w2xncnnvk* d, const AVS_VideoFrame* src, const uint64_t hash, AVS_VideoFrame* dst) noexcept
+{
+    AVS_VideoFrame* match{};
+    AVS_VideoFrame* matchSrc{};
+    bool exact{};
+
+    {
+        std::lock_guard<std::mutex> lock(d->dedupMutex);
+
+        ++d->dedupFrames;
+
+        auto it{ std::find_if(d->duplicates.begin(), d->duplicates.end(), [&](const Duplicate& e) { return e.hash == hash; }) };
+
+        if (it != d->duplicates.end())
+        {
+            d->duplicates.splice(d->duplicates.begin(), d->duplicates, it);
+            match = avs_copy_video_frame(it->dst);
+            matchSrc = avs_copy_video_frame(it->src);
+            exact = true;
+        }
+        else if (d->dedupThresh > 0.0f && !d->duplicates.empty())
+        {
+            // only the most recent frame is compared, repeats are next to each other
+            match = avs_copy_video_frame(d->duplicates.front().dst);
+            matchSrc = avs_copy_video_frame(d->duplicates.front().src);
+        }
+    }
+
+    if (!match)
+        return false;
+
+    // the sources are compared outside of the lock
+    const auto reuse{ exact ? same_frame(d, src, matchSrc) : near_frame(d, src, matchSrc) };
+
+    avs_release_video_frame(matchSrc);
+
+    if (!reuse)
+    {
+        avs_release_video_frame(match);
+        return false;
+    }
+
+    copy_planes(d, dst, match);
+
+    avs_release_video_frame(match);
+
+    std::lock_guard<std::mutex> lock(d->dedupMutex);
+    ++d->duplicateFrames;
+
+    return true;
+}
+
+static void store_duplicate(w2xncnnvk* d, const uint64_t hash, AVS_VideoFrame* src, AVS_VideoFrame* dst) noexcept
+{
+    std::lock_guard<std::mutex> lock(d->dedupMutex);
+
+    d->duplicates.push_front(Duplicate{ hash, avs_copy_video_frame(src), avs_copy_video_frame(dst) });
+
+    while (static_cast<int>(d->duplicates.size()) > d->dedup)
+    {
+        avs_release_video_frame(d->duplicates.back().src);
+        avs_release_video_frame(d->duplicates.back().dst);
+        d->duplicates.pop_back();
+    }
+}
+
+// returns the finished frames start..end-1, or nothing when the source failed
+static std::vector<AVS_VideoFrame*> process_frames(w2xncnnvk* d, const int start, const int end) noexcept
+{
+    std::vector<AVS_VideoFrame*> src;
+    std::vector<AVS_VideoFrame*> dst;
+
+    for (auto i{ start }; i < end; ++i)
+    {
+        auto frame{ avs_get_frame(d->fi->child, i) };
+        if (!frame)
+        {
+            for (auto& f : src)
+                avs_release_video_frame(f);
+            for (auto& f : dst)
+                avs_release_video_frame(f);
+
+            return {};
+        }
+
+        src.emplace_back(frame);
+        dst.emplace_back(avs_new_video_frame_p(d->fi->env, &d->fi->vi, frame));
+    }
+
+    if (d->dedup > 0)
+    {
+        // only the frames without a duplicate go through the filter, and they are kept for the following ones
+        std::vector<uint64_t> hashes;
+        std::vector<AVS_VideoFrame*> newSrc;
+        std::vector<AVS_VideoFrame*> newDst;
+
+        // a duplicate of a frame of the same batch gets a copy of its output once the batch is filtered: (dst index, newDst index)
+        std::vector<std::pair<size_t, size_t>> copies;
+
+        for (size_t i{ 0 }; i < src.size(); ++i)
+        {
+            const auto hash{ hash_frame(d, src[i]) };
+
+            if (find_duplicate(d, src[i], hash, dst[i]))
+                continue;
+
+            auto k{ newSrc.size() };
+            for (size_t j{ 0 }; j < newSrc.size() && k == newSrc.size(); ++j)
+            {
+                if (hashes[j] == hash && same_frame(d, src[i], newSrc[j]))
+                    k = j;
+            }
+
+            if (k == newSrc.size() && d->dedupThresh > 0.0f && !newSrc.empty() && near_frame(d, src[i], newSrc.back()))
+                k = newSrc.size() - 1;
+
+            if (k < newSrc.size())
+            {
+                copies.emplace_back(i, k);
+                continue;
+            }
+
+            hashes.emplace_back(hash);
+            newSrc.emplace_back(src[i]);
+            newDst.emplace_back(dst[i]);
+        }
+
+        if (!newSrc.empty())
+            filter(newSrc.data(), newDst.data(), static_cast<int>(newSrc.size()), d);
+
+        for (const auto& [i, k] : copies)
+            copy_planes(d, dst[i], newDst[k]);
+
+        if (!copies.empty())
+        {
+            std::lock_guard<std::mutex> lock(d->dedupMutex);
+            d->duplicateFrames += static_cast<int64_t>(copies.size());
+        }
+
+        for (size_t i{ 0 }; i < newSrc.size(); ++i)
+            store_duplicate(d, hashes[i], newSrc[i], newDst[i]);
+    }
+    else
+        filter(src.data(), dst.data(), static_cast<int>(src.size()), d);
+
+    for (auto& frame : src)
+        avs_release_video_frame(frame);
+
+    return dst;
+}
+
+// drops the finished frames that can't be requested by a linear reader anymore, d->mutex must be held
+static void trim_cache(w2xncnnvk* d) noexcept
+{
+    for (auto it{ d->cache.begin() }; it != d->cache.end();)
+    {
+        if (it->first < d->last || it->first >= d->last + d->batch + d->prefetch)
+        {
+            avs_release_video_frame(it->second);
+            it = d->cache.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+// stores the frames start..start+frames.size()-1, d->mutex must be held
+static void store_frames(w2xncnnvk* d, const int start, std::vector<AVS_VideoFrame*>& frames) noexcept
+{
+    for (auto i{ 0 }; i < static_cast<int>(frames.size()); ++i)
+    {
+        if (!d->cache.try_emplace(start + i, frames[i]).second)
+            avs_release_video_frame(frames[i]);
+    }
+
+    trim_cache(d);
+}
+
+static void prefetch_worker(w2xncnnvk* d) noexcept
+{
+    std::unique_lock<std::mutex> lock(d->mutex);
+
+    while (true)
+    {
+        // first frame of the lookahead window that is neither finished nor being processed
+        auto next{ -1 };
+
+        if (d->ahead >= 0)
+        {
+            for (auto i{ d->ahead }; i < (std::min)(d->ahead + d->prefetch, d->fi->vi.num_frames); ++i)
+            {
+                if (!d->cache.contains(i) && !d->inFlight.contains(i))
+                {
+                    next = i;
+                    break;
+                }
+            }
+        }
+
+        if (d->stop)
+            break;
+
+        if (next < 0)
+        {
+            d->cv.wait(lock);
+            continue;
+        }
+
+        const auto start{ next - next % d->batch };
+        const auto end{ (std::min)(start + d->batch, d->fi->vi.num_frames) };
+
+        for (auto i{ start }; i < end; ++i)
+            d->inFlight.emplace(i);
+
+        lock.unlock();
+        auto frames{ process_frames(d, start, end) };
+        lock.lock();
+
+        // stop looking ahead after an upstream error, the synchronous path reports it
+        if (frames.empty())
+            d->ahead = -1;
+        else
+            store_frames(d, start, frames);
+
+        for (auto i{ start }; i < end; ++i)
+            d->inFlight.erase(i);
+        d->cv.notify_all();
+    }
+}
+
+// runs d->init once, then the warm-up when warm is set, returns false with d->msg set when the initialization failed
+static bool init_devices(w2xncnnvk* d, const bool warm) noexcept
+{
+    if (d->initialized)
+        return d->msg.empty();
+
+    std::lock_guard<std::mutex> lock(d->initMutex);
+
+    if (!d->initialized)
+    {
+        try {
+            d->init();
+
+            // one tile per device slot, the width and height are at least a tile or the whole frame
+            for (auto& device : d->devices)
+            {
+                if (d->cancel)
+                    throw "initialization cancelled";
+
+                if (warm)
+                    device.waifu2x->warmup((std::min)(device.waifu2x->tile_w, d->fi->vi.width / device.waifu2x->scale),
+                        (std::min)(device.waifu2x->tile_h, d->fi->vi.height / device.waifu2x->scale), device.capacity);
+            }
+        }
+        // this runs on the first frame or the warm-up thread, nothing may escape to the host
+        catch (const char* error)
+        {
+            d->msg = "waifu2x_nvk: "s + error;
+        }
+        catch (const std::exception& e)
+        {
+            d->msg = "waifu2x_nvk: "s + e.what();
+        }
+        catch (...)
+        {
+            d->msg = "waifu2x_nvk: initialization failed";
+        }
+
+        if (!d->msg.empty())
+        {
+            // release the shared net and pipelines before the GPU instance can go away
+            d->devices.clear();
+
+            if (d->gpuInstance)
+                release_gpu_instance();
+            d->gpuInstance = false;
+        }
+
+        d->init = nullptr;
+        d->initialized = true;
+    }
+
+    return d->msg.empty();
 }
 
 static AVS_VideoFrame* AVSC_CC w2xncnnvk_get_frame(AVS_FilterInfo* fi, int n)
 {
     w2xncnnvk* d{ static_cast<w2xncnnvk*>(fi->user_data) };
-    auto src{ avs_get_frame(fi->child, n) };
-    if (!src)
+
+    if (!init_devices(d, false))
+    {
+        fi->error = d->msg.c_str();
         return nullptr;
+    }
 
-    auto dst{ avs_new_video_frame_p(fi->env, &fi->vi, src) };
+    std::unique_lock<std::mutex> lock(d->mutex);
 
-    filter(src, dst, d);
+    // linear access keeps the worker busy with the following frames, a seek falls back to synchronous processing
+    const auto linear{ n == d->last || n == d->last + 1 };
+    d->last = n;
+    trim_cache(d);
 
-    avs_release_video_frame(src);
+    if (d->prefetch > 0)
+    {
+        d->ahead = linear ? n + 1 : -1;
+        d->cv.notify_all();
+    }
+
+    while (d->inFlight.contains(n))
+        d->cv.wait(lock);
+
+    if (auto it{ d->cache.find(n) }; it != d->cache.end())
+        return avs_copy_video_frame(it->second);
+
+    // process the whole batch that n belongs to and keep the results for the following requests
+    const auto start{ n - n % d->batch };
+    const auto end{ (std::min)(start + d->batch, fi->vi.num_frames) };
+
+    for (auto i{ start }; i < end; ++i)
+        d->inFlight.emplace(i);
+
+    lock.unlock();
+    auto frames{ process_frames(d, start, end) };
+    lock.lock();
+
+    for (auto i{ start }; i < end; ++i)
+        d->inFlight.erase(i);
+    d->cv.notify_all();
+
+    if (frames.empty())
+        return nullptr;
+
+    auto dst{ avs_copy_video_frame(frames[n - start]) };
+    store_frames(d, start, frames);
 
     return dst;
 }
@@ -84,20 +779,61 @@ static AVS_VideoFrame* AVSC_CC w2xncnnvk_get_frame(AVS_FilterInfo* fi, int n)
 static void AVSC_CC free_w2xncnnvk(AVS_FilterInfo* fi)
 {
     auto d{ static_cast<w2xncnnvk*>(fi->user_data) };
+
+    // the warm-up may still be creating the devices and the workers, it stops after the current model or tile
+    if (d->warmupThread.joinable())
+    {
+        d->cancel = true;
+        d->warmupThread.join();
+    }
+
+    const auto gpuInstance{ d->gpuInstance };
+
+    if (!d->workers.empty())
+    {
+        {
+            std::lock_guard<std::mutex> lock(d->mutex);
+            d->stop = true;
+        }
+        d->cv.notify_all();
+
+        for (auto& worker : d->workers)
+            worker.join();
+    }
+
+    for (auto& frame : d->cache)
+        avs_release_video_frame(frame.second);
+
+    for (auto& duplicate : d->duplicates)
+    {
+        avs_release_video_frame(duplicate.src);
+        avs_release_video_frame(duplicate.dst);
+    }
+
+    if (d->collectStats)
+        report_stats(d);
+
     delete d;
 
-    if (--numGPUInstances == 0)
-        ncnn::destroy_gpu_instance();
+    if (gpuInstance)
+        release_gpu_instance();
 }
 
 static int AVSC_CC w2xncnnvk_set_cache_hints(AVS_FilterInfo* fi, int cachehints, int frame_range)
 {
-    return cachehints == AVS_CACHE_GET_MTMODE ? 2 : 0;
+    // the batch and lookahead caches are shared by the threads requesting their frames, so they need a single instance,
+    // otherwise one instance serves all the threads: they wait for a free device slot (gpu_thread per device)
+    // and each running frame takes one of the upscaler's contexts, so the model and GPU memory aren't multiplied by Prefetch()
+    const auto d{ static_cast<w2xncnnvk*>(fi->user_data) };
+
+    if (cachehints != AVS_CACHE_GET_MTMODE)
+        return 0;
+    return (d->batch > 1 || d->prefetch > 0) ? 3 : 1;
 }
 
 static AVS_Value AVSC_CC Create_w2xncnnvk(AVS_ScriptEnvironment* env, AVS_Value args, void* param)
 {
-    enum { Clip, Noise, Scale, Tile_w, Tile_h, Model, Gpu_id, Gpu_thread, Tta, Fp32, List_gpu };
+    enum { Clip, Noise, Scale, Tile_w, Tile_h, Model, Gpu_id, Gpu_thread, Tta, Fp32, List_gpu, Cpu_thread, Batch, Prefetch, Matrix, Full, Fp16_io, Vram_budget, Spirv_cache, Stats, Tile_cache, Dedup, Dedup_thresh, Whole_frame, Int8, Warmup };
 
     auto d{ new w2xncnnvk() };
 
@@ -117,43 +853,126 @@ static AVS_Value AVSC_CC Create_w2xncnnvk(AVS_ScriptEnvironment* env, AVS_Value
             throw "AviSynth+ version must be r3688 or later.";
 
         if (!avs_is_planar(&d->fi->vi) ||
-            !avs_is_rgb(&d->fi->vi) ||
-            avs_component_size(&d->fi->vi) < 4)
-            throw "only RGB 32-bit planar format supported";
+            !(avs_num_components(&d->fi->vi) == 3 || (avs_num_components(&d->fi->vi) == 4 && avs_is_rgb(&d->fi->vi))) ||
+            !(avs_is_rgb(&d->fi->vi) || avs_is_444(&d->fi->vi) || avs_is_420(&d->fi->vi)))
+            throw "only planar RGB(A), YUV444 and YUV420 8..16-bit and 32-bit formats supported";
+
+        const auto listGpu{ avs_defined(avs_array_elt(args, List_gpu)) ? avs_as_bool(avs_array_elt(args, List_gpu)) : 0 };
+
+        // gpu_id is a device index, or a string with a comma separated list of them or "all"
+        std::vector<int> gpuIds;
+        auto allGpus{ false };
+
+        if (const auto gpuIdArg{ avs_array_elt(args, Gpu_id) }; !avs_defined(gpuIdArg))
+            gpuIds.emplace_back(0);
+        else if (avs_is_int(gpuIdArg))
+            gpuIds.emplace_back(avs_as_int(gpuIdArg));
+        else if (avs_is_string(gpuIdArg) && avs_as_string(gpuIdArg) == "all"sv)
+            allGpus = true;
+        else if (avs_is_string(gpuIdArg))
+        {
+            std::string list{ avs_as_string(gpuIdArg) };
+
+            for (size_t pos{ 0 }; pos <= list.size();)
+            {
+                const auto comma{ (std::min)(list.find(',', pos), list.size()) };
+                const auto item{ list.substr(pos, comma - pos) };
+
+                char* end{};
+                const auto id{ std::strtol(item.c_str(), &end, 10) };
+                if (item.empty() || *end)
+                    throw "gpu_id must be an integer, a list like \"0,1\" or \"all\"";
 
-        if (ncnn::create_gpu_instance())
-            throw "failed to create GPU instance";
-        ++numGPUInstances;
+                gpuIds.emplace_back(static_cast<int>(id));
+                pos = comma + 1;
+            }
+        }
+        else
+            throw "gpu_id must be an integer, a list like \"0,1\" or \"all\"";
 
         const auto noise{ avs_defined(avs_array_elt(args, Noise)) ? avs_as_int(avs_array_elt(args, Noise)) : 0 };
         const auto scale{ avs_defined(avs_array_elt(args, Scale)) ? avs_as_int(avs_array_elt(args, Scale)) : 2 };
-        const auto tile_w{ avs_defined(avs_array_elt(args, Tile_w)) ? avs_as_int(avs_array_elt(args, Tile_w)) : (std::max)(d->fi->vi.width, 32) };
-        const auto tile_h{ avs_defined(avs_array_elt(args, Tile_h)) ? avs_as_int(avs_array_elt(args, Tile_h)) : (std::max)(d->fi->vi.height, 32) };
+        auto tile_w{ avs_defined(avs_array_elt(args, Tile_w)) ? avs_as_int(avs_array_elt(args, Tile_w)) : (std::max)(d->fi->vi.width, 32) };
+        auto tile_h{ avs_defined(avs_array_elt(args, Tile_h)) ? avs_as_int(avs_array_elt(args, Tile_h)) : (std::max)(d->fi->vi.height, 32) };
         const auto model{ avs_defined(avs_array_elt(args, Model)) ? avs_as_int(avs_array_elt(args, Model)) : 2 };
-        const auto gpuId{ avs_defined(avs_array_elt(args, Gpu_id)) ? avs_as_int(avs_array_elt(args, Gpu_id)) : ncnn::get_default_gpu_index() };
         const auto gpuThread{ avs_defined(avs_array_elt(args, Gpu_thread)) ? avs_as_int(avs_array_elt(args, Gpu_thread)) : 2 };
-        const auto tta{ avs_defined(avs_array_elt(args, Tta)) ? avs_as_bool(avs_array_elt(args, Tta)) : 0 };
+        // tta is the number of transforms, true is all eight of them
+        const auto ttaArg{ avs_array_elt(args, Tta) };
+        const auto tta{ !avs_defined(ttaArg) ? 1 : avs_is_bool(ttaArg) ? (avs_as_bool(ttaArg) ? 8 : 1) : avs_is_int(ttaArg) ? avs_as_int(ttaArg) : 0 };
         const auto fp32{ avs_defined(avs_array_elt(args, Fp32)) ? avs_as_bool(avs_array_elt(args, Fp32)) : 0 };
+        const auto cpuThread{ avs_defined(avs_array_elt(args, Cpu_thread)) ? avs_as_int(avs_array_elt(args, Cpu_thread)) : static_cast<int>((std::max)(std::thread::hardware_concurrency(), 1u)) };
+        d->batch = avs_defined(avs_array_elt(args, Batch)) ? avs_as_int(avs_array_elt(args, Batch)) : 1;
+        d->prefetch = avs_defined(avs_array_elt(args, Prefetch)) ? avs_as_int(avs_array_elt(args, Prefetch)) : 0;
+        const auto matrix{ avs_defined(avs_array_elt(args, Matrix)) ? avs_as_int(avs_array_elt(args, Matrix)) : ((d->fi->vi.width > 1024 || d->fi->vi.height > 576) ? 1 : 6) };
+        const auto full{ avs_defined(avs_array_elt(args, Full)) ? avs_as_bool(avs_array_elt(args, Full)) : 0 };
+        const auto fp16Io{ avs_defined(avs_array_elt(args, Fp16_io)) ? avs_as_bool(avs_array_elt(args, Fp16_io)) : 0 };
+        d->collectStats = avs_defined(avs_array_elt(args, Stats)) ? avs_as_bool(avs_array_elt(args, Stats)) : 0;
+        const auto vramBudget{ avs_defined(avs_array_elt(args, Vram_budget)) ? avs_as_int(avs_array_elt(args, Vram_budget)) : 0 };
+        const auto tileCache{ avs_defined(avs_array_elt(args, Tile_cache)) ? avs_as_int(avs_array_elt(args, Tile_cache)) : 0 };
+        d->dedup = avs_defined(avs_array_elt(args, Dedup)) ? avs_as_int(avs_array_elt(args, Dedup)) : 0;
+        d->dedupThresh = avs_defined(avs_array_elt(args, Dedup_thresh)) ? static_cast<float>(avs_as_float(avs_array_elt(args, Dedup_thresh))) : 0.0f;
+        const auto wholeFrame{ avs_defined(avs_array_elt(args, Whole_frame)) ? avs_as_bool(avs_array_elt(args, Whole_frame)) : 0 };
+        const auto int8{ avs_defined(avs_array_elt(args, Int8)) ? avs_as_bool(avs_array_elt(args, Int8)) : 0 };
+        d->warmup = avs_defined(avs_array_elt(args, Warmup)) ? avs_as_bool(avs_array_elt(args, Warmup)) : 0;
+        const auto gpuIdDefined{ avs_defined(avs_array_elt(args, Gpu_id)) != 0 };
+
+        // int8 runs on the CPU backend only, so it's the default device then
+        if (int8 && !gpuIdDefined)
+            gpuIds = { -1 };
 
         if (noise < -1 || noise > 3)
             throw "noise must be between -1 and 3 (inclusive)";
-        if (scale < 1 || scale > 2)
-            throw "scale must be 1 or 2";
-        if (tile_w < 32)
-            throw "tile_w must be at least 32";
-        if (tile_h < 32)
-            throw "tile_h must be at least 32";
+        if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+            throw "scale must be 1, 2, 4 or 8";
+        if (tile_w != 0 && tile_w < 32)
+            throw "tile_w must be 0 or at least 32";
+        if (tile_h != 0 && tile_h < 32)
+            throw "tile_h must be 0 or at least 32";
         if (model < 0 || model > 2)
             throw "model must be between 0 and 2 (inclusive)";
+        if (tta != 1 && tta != 2 && tta != 4 && tta != 8)
+            throw "tta must be true, false, 1, 2, 4 or 8";
         if (model != 2 && scale == 1)
             throw "only cunet model supports scale=1";
-        if (gpuId < 0 || gpuId >= ncnn::get_gpu_count())
-            throw "invalid GPU device";
-        if (auto queue_count{ ncnn::get_gpu_info(gpuId).compute_queue_count() }; gpuThread < 1 || static_cast<uint32_t>(gpuThread) > queue_count)
-            throw ("gpu_thread must be between 1 and " + std::to_string(queue_count) + " (inclusive)").c_str();
+        // the devices are checked again when they are created, the default and "all" are only known then
+        for (const auto gpuId : gpuIds)
+        {
+            if (gpuId < -1)
+                throw "invalid GPU device";
+            if (gpuId == -1 && scale > 2)
+                throw "scale 4 and 8 need a GPU device";
+            if (gpuId != -1 && int8)
+                throw "int8 is only supported with gpu_id=-1";
+        }
+        if (gpuThread < 1)
+            throw "gpu_thread must be at least 1";
+        if (cpuThread < 1)
+            throw "cpu_thread must be at least 1";
+        if (d->batch < 1)
+            throw "batch must be at least 1";
+        if (d->prefetch < 0)
+            throw "prefetch must be at least 0";
+        if (matrix != 1 && matrix != 5 && matrix != 6 && matrix != 9)
+            throw "matrix must be 1, 5, 6 or 9";
+        if (vramBudget < 0)
+            throw "vram_budget must be at least 0";
+        if (tileCache < 0)
+            throw "tile_cache must be at least 0";
+        if (d->dedup < 0)
+            throw "dedup must be at least 0";
+        if (d->dedupThresh < 0.0f)
+            throw "dedup_thresh must be at least 0.0";
+
+        const auto bits{ (avs_component_size(&d->fi->vi) == 4) ? 32 : avs_bits_per_component(&d->fi->vi) };
+        const auto yuv{ avs_is_rgb(&d->fi->vi) ? 0 : (avs_is_420(&d->fi->vi) ? 2 : 1) };
 
-        if (avs_defined(avs_array_elt(args, List_gpu)) ? avs_as_bool(avs_array_elt(args, List_gpu)) : 0)
+        if (listGpu)
         {
+            if (!acquire_gpu_instance())
+                throw "failed to create GPU instance";
+
+            d->gpuInstance = true;
+
             for (auto i{ 0 }; i < ncnn::get_gpu_count(); ++i)
                 d->msg += std::to_string(i) + ": " + ncnn::get_gpu_info(i).device_name() + "\n";
 
@@ -164,8 +983,8 @@ static AVS_Value AVSC_CC Create_w2xncnnvk(AVS_ScriptEnvironment* env, AVS_Value
             avs_release_value(cl);
             avs_release_clip(clip);
 
-            if (--numGPUInstances == 0)
-                ncnn::destroy_gpu_instance();
+            release_gpu_instance();
+            d->gpuInstance = false;
 
             return v;
         }
@@ -176,12 +995,12 @@ static AVS_Value AVSC_CC Create_w2xncnnvk(AVS_ScriptEnvironment* env, AVS_Value
 
             avs_release_clip(clip);
 
-            if (--numGPUInstances == 0)
-                ncnn::destroy_gpu_instance();
-
             return v;
         }
 
+        const auto width{ d->fi->vi.width };
+        const auto height{ d->fi->vi.height };
+
         d->fi->vi.width *= scale;
         d->fi->vi.height *= scale;
 
@@ -205,7 +1024,7 @@ static AVS_Value AVSC_CC Create_w2xncnnvk(AVS_ScriptEnvironment* env, AVS_Value
             case 2:
             {
                 modelDir += "/models-cunet";
-                prepadding = (noise == -1 || scale == 2) ? 18 : 28;
+                prepadding = (noise == -1 || scale >= 2) ? 18 : 28;
                 break;
             }
         }
@@ -228,12 +1047,33 @@ static AVS_Value AVSC_CC Create_w2xncnnvk(AVS_ScriptEnvironment* env, AVS_Value
             modelPath = modelDir + "/noise" + std::to_string(noise) + "_scale2.0x_model.bin";
         }
 
+        // the quantized models made with tools/w2xcalib.cpp and ncnn2int8 are next to the float ones
+        if (int8)
+        {
+            paramPath.insert(paramPath.size() - 6, ".int8");
+            modelPath.insert(modelPath.size() - 4, ".int8");
+        }
+
+        // a binary param (ncnn2mem) alone is enough
         std::ifstream ifs{ paramPath };
         if (!ifs.is_open())
-            throw "failed to load model";
+            ifs.open(paramPath + ".bin");
+        if (!ifs.is_open())
+            throw int8 ? "failed to load int8 model, create it with tools/w2xcalib.cpp" : "failed to load model";
         ifs.close();
 
-        d->waifu2x = std::make_unique<Waifu2x>(gpuId, tta, 1);
+        std::filesystem::path spirvCache;
+
+        if (avs_defined(avs_array_elt(args, Spirv_cache)))
+            spirvCache = std::filesystem::path(reinterpret_cast<const char8_t*>(avs_as_string(avs_array_elt(args, Spirv_cache))));
+        else
+        {
+            std::error_code ec;
+            const auto temp{ std::filesystem::temp_directory_path(ec) };
+
+            if (!ec)
+                spirvCache = temp / "w2xncnnvk";
+        }
 
 #ifdef _WIN32
         const auto paramBufferSize{ MultiByteToWideChar(CP_UTF8, 0, paramPath.c_str(), -1, nullptr, 0) };
@@ -242,26 +1082,148 @@ static AVS_Value AVSC_CC Create_w2xncnnvk(AVS_ScriptEnvironment* env, AVS_Value
         std::vector<wchar_t> wmodelPath(modelBufferSize);
         MultiByteToWideChar(CP_UTF8, 0, paramPath.c_str(), -1, wparamPath.data(), paramBufferSize);
         MultiByteToWideChar(CP_UTF8, 0, modelPath.c_str(), -1, wmodelPath.data(), modelBufferSize);
-        d->waifu2x->load(wparamPath.data(), wmodelPath.data(), fp32);
+#endif
+
+        // opening the script only checks the arguments, the GPU instance, the devices and the models are created
+        // by the first frame, or by the warm-up thread started below
+        d->init = [=]() mutable
+        {
+            if (allGpus || std::any_of(gpuIds.begin(), gpuIds.end(), [](int id) { return id != -1; }))
+            {
+                if (!acquire_gpu_instance())
+                {
+                    // no usable Vulkan device, fall back to the CPU unless a GPU was explicitly requested
+                    if (gpuIdDefined)
+                        throw "failed to create GPU instance";
+
+                    gpuIds = { -1 };
+                }
+                else
+                {
+                    d->gpuInstance = true;
+
+                    if (!gpuIdDefined)
+                        gpuIds = { (ncnn::get_gpu_count() > 0) ? ncnn::get_default_gpu_index() : -1 };
+
+                    if (allGpus)
+                    {
+                        for (auto i{ 0 }; i < ncnn::get_gpu_count(); ++i)
+                            gpuIds.emplace_back(i);
+
+                        if (gpuIds.empty())
+                            throw "no GPU device";
+                    }
+                }
+            }
+
+            for (const auto gpuId : gpuIds)
+            {
+                if (gpuId > -1 && gpuId >= ncnn::get_gpu_count())
+                    throw "invalid GPU device";
+                if (gpuId == -1 && scale > 2)
+                    throw "scale 4 and 8 need a GPU device";
+                if (gpuId != -1 && int8)
+                    throw "int8 is only supported with gpu_id=-1";
+                if (auto queue_count{ (gpuId == -1) ? 0u : ncnn::get_gpu_info(gpuId).compute_queue_count() }; gpuId != -1 && static_cast<uint32_t>(gpuThread) > queue_count)
+                {
+                    // the message has to outlive the unwinding, init_devices copies it
+                    d->msg = "gpu_thread must be between 1 and " + std::to_string(queue_count) + " (inclusive)";
+                    throw d->msg.c_str();
+                }
+            }
+
+            // time spent loading the model and creating the pipelines, to compare cold and warm starts
+            std::chrono::steady_clock::duration loadTime{};
+
+            for (const auto gpuId : gpuIds)
+            {
+                if (d->cancel)
+                    throw "initialization cancelled";
+
+                auto& device{ d->devices.emplace_back(Device{ std::make_unique<Waifu2x>(gpuId, tta, cpuThread), gpuThread, 0, 0.0 }) };
+                auto& waifu2x{ device.waifu2x };
+
+                waifu2x->bits = bits;
+                waifu2x->yuv = yuv;
+                waifu2x->matrix = matrix;
+                waifu2x->full_range = full;
+                waifu2x->fp16_io = fp16Io;
+                waifu2x->alpha = avs_num_components(&d->fi->vi) == 4;
+                waifu2x->whole_frame = wholeFrame;
+                waifu2x->int8 = int8;
+                // the passes of scale 4 and 8 need pipelines of their own
+                waifu2x->scale = scale;
+                waifu2x->spirv_cache = spirvCache;
+                // tile_cache is in MiB
+                waifu2x->tile_cache_size = static_cast<size_t>(tileCache) << 20;
+
+                const auto loadStart{ std::chrono::steady_clock::now() };
+
+#ifdef _WIN32
+                waifu2x->load(wparamPath.data(), wmodelPath.data(), fp32);
 #else
-        d->waifu2x->load(paramPath, modelPath, fp32);
+                waifu2x->load(paramPath, modelPath, fp32);
 #endif
 
-        d->waifu2x->noise = noise;
-        d->waifu2x->scale = scale;
-        d->waifu2x->tile_w = tile_w;
-        d->waifu2x->tile_h = tile_h;
-        d->waifu2x->prepadding = prepadding;
+                loadTime += std::chrono::steady_clock::now() - loadStart;
+
+                waifu2x->noise = noise;
+                waifu2x->tile_w = tile_w;
+                waifu2x->tile_h = tile_h;
+                waifu2x->prepadding = prepadding;
+
+                if (d->cancel)
+                    throw "initialization cancelled";
 
-        d->semaphore = std::make_unique<std::counting_semaphore<>>(gpuThread);
+                if (tile_w == 0 || tile_h == 0)
+                {
+                    const auto key{ ((gpuId == -1) ? "cpu"s : ncnn::get_gpu_info(gpuId).device_name()) + "|" + paramPath + "|" + std::to_string(width) + "x" +
+                        std::to_string(height) + "|" + std::to_string(scale) + "|" + std::to_string(bits) + "|" + std::to_string(avs_num_components(&d->fi->vi)) + "|" + std::to_string(yuv) + "|" + std::to_string(tta) + std::to_string(fp32) + std::to_string(fp16Io) + std::to_string(wholeFrame) +
+                        "|" + std::to_string(tile_w) + "x" + std::to_string(tile_h) + "|" + std::to_string(gpuThread) + "|" + std::to_string(cpuThread) + "|" + std::to_string(vramBudget) };
+
+                    std::lock_guard<std::mutex> lock(tunedTilesMutex);
+
+                    if (auto it{ tunedTiles.find(key) }; it != tunedTiles.end())
+                    {
+                        waifu2x->tile_w = it->second.first;
+                        waifu2x->tile_h = it->second.second;
+                    }
+                    else
+                    {
+                        // vram_budget is in MiB, the default is what the device reports as available
+                        const auto budget{ (vramBudget > 0) ? static_cast<size_t>(vramBudget) << 20 :
+                            (gpuId == -1) ? SIZE_MAX : static_cast<size_t>(ncnn::get_gpu_device(gpuId)->get_heap_budget()) << 20 };
+
+                        waifu2x->autotune(width, height, gpuThread, budget, tile_w == 0, tile_h == 0);
+                        tunedTiles.emplace(key, std::make_pair(waifu2x->tile_w, waifu2x->tile_h));
+                    }
+                }
+
+                waifu2x->align_tiles();
+            }
+
+            // the script environment belongs to the thread parsing the script, the load time goes to the stats instead of a global variable
+            d->loadTime = std::chrono::duration<double, std::milli>(loadTime).count();
+
+            // one worker per device, so that all of them are kept busy
+            if (d->prefetch > 0)
+            {
+                for (size_t i{ 0 }; i < d->devices.size(); ++i)
+                    d->workers.emplace_back(prefetch_worker, d);
+            }
+        };
     }
     catch (const char* error)
     {
         d->msg = "waifu2x_nvk: "s + error;
         v = avs_new_value_error(d->msg.c_str());
 
-        if (--numGPUInstances == 0)
-            ncnn::destroy_gpu_instance();
+        // release the shared net and pipelines before the GPU instance can go away
+        d->devices.clear();
+
+        if (d->gpuInstance)
+            release_gpu_instance();
+        d->gpuInstance = false;
     }
 
     if (!avs_defined(v))
@@ -272,6 +1234,9 @@ static AVS_Value AVSC_CC Create_w2xncnnvk(AVS_ScriptEnvironment* env, AVS_Value
         d->fi->get_frame = w2xncnnvk_get_frame;
         d->fi->set_cache_hints = w2xncnnvk_set_cache_hints;
         d->fi->free_filter = free_w2xncnnvk;
+
+        if (d->warmup)
+            d->warmupThread = std::thread(init_devices, d, true);
     }
 
     avs_release_clip(clip);
@@ -281,6 +1246,6 @@ static AVS_Value AVSC_CC Create_w2xncnnvk(AVS_ScriptEnvironment* env, AVS_Value
 
 const char* AVSC_CC avisynth_c_plugin_init(AVS_ScriptEnvironment* env)
 {
-    avs_add_function(env, "w2xncnnvk", "c[noise]i[scale]i[tile_w]i[tile_h]i[model]i[gpu_id]i[gpu_thread]i[tta]b[fp32]b[list_gpu]b", Create_w2xncnnvk, 0);
+    avs_add_function(env, "w2xncnnvk", "c[noise]i[scale]i[tile_w]i[tile_h]i[model]i[gpu_id].[gpu_thread]i[tta].[fp32]b[list_gpu]b[cpu_thread]i[batch]i[prefetch]i[matrix]i[full]b[fp16_io]b[vram_budget]i[spirv_cache]s[stats]b[tile_cache]i[dedup]i[dedup_thresh]f[whole_frame]b[int8]b[warmup]b", Create_w2xncnnvk, 0);
     return "waifu2x ncnn Vulkan";
 }
@@ -1,9 +1,41 @@
 // waifu2x implemented with ncnn library
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#if _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// ncnn
+#include "ncnn/datareader.h"
+#include "ncnn/layer_type.h"
+
+#include "fp16.h"
 #include "waifu2x.h"
 
 #include "waifu2x_postproc.comp.hex.h"
@@ -11,443 +43,2350 @@
 #include "waifu2x_preproc.comp.hex.h"
 #include "waifu2x_preproc_tta.comp.hex.h"
 
-Waifu2x::Waifu2x(int gpuid, bool _tta_mode, int num_threads)
-{
-    vkdev = gpuid == -1 ? 0 : ncnn::get_gpu_device(gpuid);
+// a read-only mapping of a model file, the page cache holds it once for every process mapping the same file
+// data is null when the file can't be mapped
+struct MappedFile
+{
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+#if _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+
+    explicit MappedFile(const std::filesystem::path& path)
+    {
+#if _WIN32
+        file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return;
+
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+            return;
+
+        mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping)
+            return;
+
+        data = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (data)
+            size = static_cast<size_t>(file_size.QuadPart);
+#else
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1)
+            return;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                data = static_cast<const unsigned char*>(p);
+                size = st.st_size;
+            }
+        }
+
+        // the mapping keeps the file open
+        close(fd);
+#endif
+    }
+
+    ~MappedFile()
+    {
+#if _WIN32
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+#else
+        if (data)
+            munmap(const_cast<unsigned char*>(data), size);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+};
+
+// runs the tile rows of process() one after another while the calling thread copies the neighbouring rows,
+// the thread is started once instead of for every row
+struct RowWorker
+{
+    std::mutex lock;
+    std::condition_variable cv;
+    std::function<void()> job;
+    std::exception_ptr error;
+    bool stop = false;
+    std::thread thread{ [this] { loop(); } }; // last, the loop uses the other members
+
+    ~RowWorker()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop = true;
+        }
+        cv.notify_all();
+
+        thread.join();
+    }
+
+    // the previous row must have been waited for
+    void submit(std::function<void()> row)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            job = std::move(row);
+        }
+        cv.notify_all();
+    }
+
+    // waits for the row in flight, if any, and rethrows what it threw
+    void wait()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        cv.wait(guard, [this] { return !job; });
+
+        if (error)
+            std::rethrow_exception(std::exchange(error, nullptr));
+    }
+
+    void loop()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+
+        for (;;)
+        {
+            cv.wait(guard, [this] { return job || stop; });
+
+            if (stop)
+                return;
+
+            guard.unlock();
+
+            try
+            {
+                job();
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+
+            guard.lock();
+
+            job = nullptr;
+            cv.notify_all();
+        }
+    }
+};
+
+// preprocess and postprocess pipelines, shared by the instances with the same device, precision and format
+struct Waifu2x::Pipelines
+{
+    ncnn::Option opt;
+    ncnn::Pipeline* preproc = 0;
+    ncnn::Pipeline* postproc = 0;
+    ncnn::Layer* bicubic_2x = 0;
+
+    ~Pipelines()
+    {
+        delete preproc;
+        delete postproc;
+
+        if (bicubic_2x)
+        {
+            bicubic_2x->destroy_pipeline(opt);
+            delete bicubic_2x;
+        }
+    }
+};
+
+// upscaled tiles keyed by the hash of their input, least recently used first out
+// the input is kept with the tile, a hit must have the same input and not only the same hash
+// the tiles are shared so that a lookup stays valid while the tile is evicted
+struct Waifu2x::TileCache
+{
+    using Tile = std::shared_ptr<const std::vector<uint8_t>>;
+
+    struct Entry
+    {
+        std::vector<uint8_t> input;
+        Tile tile;
+    };
+
+    ncnn::Mutex lock;
+    std::list<std::pair<uint64_t, Entry>> tiles; // most recently used first
+    std::unordered_map<uint64_t, std::list<std::pair<uint64_t, Entry>>::iterator> index;
+    size_t size = 0;
+
+    Tile find(const uint64_t key, const std::vector<uint8_t>& input)
+    {
+        ncnn::MutexLockGuard guard(lock);
+
+        auto it = index.find(key);
+        if (it == index.end() || it->second->second.input != input)
+            return nullptr;
+
+        tiles.splice(tiles.begin(), tiles, it->second);
+        return it->second->second.tile;
+    }
+
+    void insert(const uint64_t key, std::vector<uint8_t> input, Tile tile, const size_t budget)
+    {
+        ncnn::MutexLockGuard guard(lock);
+
+        const size_t entry_size = input.size() + tile->size();
+        if (entry_size > budget || index.count(key))
+            return;
+
+        size += entry_size;
+        tiles.emplace_front(key, Entry{ std::move(input), std::move(tile) });
+        index.emplace(key, tiles.begin());
+
+        while (size > budget)
+        {
+            size -= tiles.back().second.input.size() + tiles.back().second.tile->size();
+            index.erase(tiles.back().first);
+            tiles.pop_back();
+        }
+    }
+};
+
+// the device memory and command buffers of one process() call in flight, kept for the next calls
+// the allocators hold on to their memory, so once a context has run a frame the same blocks and staging buffers are reused
+struct Waifu2x::Context
+{
+    // counts the bytes of the blobs alive and their peak
+    struct BlobAllocator : public ncnn::VkBlobAllocator
+    {
+        using ncnn::VkBlobAllocator::VkBlobAllocator;
+        using ncnn::VkBlobAllocator::fastMalloc;
+        using ncnn::VkBlobAllocator::fastFree;
+
+        std::atomic<size_t> used{ 0 };
+        std::atomic<size_t> peak{ 0 };
+
+        ncnn::VkBufferMemory* fastMalloc(size_t size) override
+        {
+            ncnn::VkBufferMemory* ptr = ncnn::VkBlobAllocator::fastMalloc(size);
+
+            if (ptr)
+            {
+                const size_t now = used += ptr->capacity;
+
+                size_t old = peak;
+                while (now > old && !peak.compare_exchange_weak(old, now))
+                    ;
+            }
+
+            return ptr;
+        }
+
+        void fastFree(ncnn::VkBufferMemory* ptr) override
+        {
+            if (ptr)
+                used -= ptr->capacity;
+
+            ncnn::VkBlobAllocator::fastFree(ptr);
+        }
+    };
+
+    // the blocks have the default size of the device's allocators, the allocator adds blocks and fits larger blobs in blocks of their own
+    explicit Context(const ncnn::VulkanDevice* vkdev)
+        : blob_allocator(vkdev), staging_allocator(vkdev), row_staging_allocator(vkdev), cmd(vkdev), row_cmd(vkdev)
+    {
+    }
+
+    BlobAllocator blob_allocator;
+    ncnn::VkStagingAllocator staging_allocator; // the rows and frames copied by the calling thread
+    ncnn::VkStagingAllocator row_staging_allocator; // the extractors on the worker thread
+    ncnn::VkCompute cmd; // the whole frame copies, on the calling thread
+    ncnn::VkCompute row_cmd; // the tile rows, on the worker thread
+    ncnn::Option opt;
+    RowWorker worker; // last, its thread is joined before the rest goes away
+};
+
+// the contexts of an instance, one for every process() call running at the same time
+struct Waifu2x::ContextPool
+{
+    ncnn::Mutex lock;
+    std::vector<std::unique_ptr<Context>> contexts;
+    std::vector<Context*> idle;
+};
+
+Waifu2x::Waifu2x(int gpuid, int _tta_level, int _num_threads)
+{
+    vkdev = gpuid == -1 ? 0 : ncnn::get_gpu_device(gpuid);
+
+    waifu2x_preproc = 0;
+    waifu2x_postproc = 0;
+    rgb_preproc = 0;
+    rgb_postproc = 0;
+    bicubic_2x = 0;
+    tta_level = (_tta_level >= 8) ? 8 : (_tta_level >= 4) ? 4 : (_tta_level >= 2) ? 2 : 1;
+    num_threads = (std::max)(_num_threads, 1);
+
+    scale = 2;
+    bits = 32;
+    yuv = 0;
+    matrix = 1;
+    full_range = false;
+    fp16_io = false;
+    alpha = false;
+    tile_cache_size = 0;
+    tile_cache = std::make_unique<TileCache>();
+    context_pool = std::make_unique<ContextPool>();
+    stack_tta = true;
+    whole_frame = false;
+    int8 = false;
+    map_model = true;
+    tta_stackable = false;
+    input_blob = 0;
+    output_blob = 0;
+}
+
+Waifu2x::~Waifu2x()
+{
+    // the shared net and pipelines are released with the last instance using them,
+    // the contexts go first as their allocators and commands belong to the device
+    context_pool.reset();
+}
+
+#if _WIN32
+int Waifu2x::load(const std::wstring& parampath, const std::wstring& modelpath, const bool fp32)
+#else
+int Waifu2x::load(const std::string& parampath, const std::string& modelpath, const bool fp32)
+#endif
+{
+#if _WIN32
+    typedef std::wstring path_t;
+#else
+    typedef std::string path_t;
+#endif
+
+    // nets and pipelines already loaded by other instances, an entry lives as long as an instance uses it
+    static ncnn::Mutex lock;
+    static std::map<std::tuple<const ncnn::VulkanDevice*, path_t, path_t, bool>, std::weak_ptr<ncnn::Net>> nets;
+    static std::map<std::tuple<const ncnn::VulkanDevice*, bool, int, int, int, bool>, std::weak_ptr<Pipelines>> shared_pipelines;
+
+    init_format();
+
+    ncnn::MutexLockGuard guard(lock);
+
+    // drop the entries of the models and formats no instance uses anymore
+    std::erase_if(nets, [](const auto& entry) { return entry.second.expired(); });
+    std::erase_if(shared_pipelines, [](const auto& entry) { return entry.second.expired(); });
+
+    std::weak_ptr<ncnn::Net>& shared_net = nets[std::make_tuple(vkdev, parampath, modelpath, fp32)];
+    net = shared_net.lock();
+
+    if (!net)
+    {
+        // ncnn uses the weights it doesn't convert straight from the mapping, so it lives as long as the net
+        std::shared_ptr<MappedFile> model = map_model ? std::make_shared<MappedFile>(modelpath) : nullptr;
+        if (model && !model->data)
+            model.reset();
+
+        net = std::shared_ptr<ncnn::Net>(new ncnn::Net, [model](ncnn::Net* p) { delete p; });
+
+        // the net is shared by instances with different cpu_thread, the CPU backend sets the threads on every extractor
+        net->opt.num_threads = 1;
+        net->opt.use_vulkan_compute = vkdev ? true : false;
+        net->opt.use_fp16_packed = !fp32;
+        net->opt.use_fp16_storage = !fp32;
+        net->opt.use_fp16_arithmetic = false;
+        net->opt.use_int8_storage = false;
+        // the int8 layers of a quantized model run on the CPU only
+        net->opt.use_int8_inference = int8 && !vkdev;
+
+        net->set_vulkan_device(vkdev);
+
+        // the binary param written by ncnn2mem next to the text one needs no parsing
+#if _WIN32
+        const path_t parambinpath = parampath + L".bin";
+#else
+        const path_t parambinpath = parampath + ".bin";
+#endif
+        const bool parambin = std::filesystem::exists(parambinpath);
+
+#if _WIN32
+        {
+            FILE* fp = _wfopen((parambin ? parambinpath : parampath).c_str(), L"rb");
+            if (!fp)
+                fwprintf(stderr, L"_wfopen %ls failed\n", (parambin ? parambinpath : parampath).c_str());
+
+            if (parambin)
+                net->load_param_bin(fp);
+            else
+                net->load_param(fp);
+
+            fclose(fp);
+        }
+#else
+        if (parambin)
+            net->load_param_bin(parambinpath.c_str());
+        else
+            net->load_param(parampath.c_str());
+#endif
+
+        if (model)
+        {
+            const unsigned char* mem = model->data;
+            const ncnn::DataReaderFromMemory dr(mem);
+
+            net->load_model(dr);
+        }
+        else
+        {
+#if _WIN32
+            FILE* fp = _wfopen(modelpath.c_str(), L"rb");
+            if (!fp)
+                fwprintf(stderr, L"_wfopen %ls failed\n", modelpath.c_str());
+
+            net->load_model(fp);
+
+            fclose(fp);
+#else
+            net->load_model(modelpath.c_str());
+#endif
+        }
+
+        shared_net = net;
+    }
+
+    // the transforms can only be stacked into one blob when every output row depends on nearby input rows only,
+    // the squeeze-and-excitation blocks of cunet pool over the whole blob
+    // the binary param has no layer and blob names
+    tta_stackable = std::none_of(net->layers().begin(), net->layers().end(), [](const ncnn::Layer* layer) { return layer->typeindex == ncnn::LayerType::Pooling; });
+
+    // the input is the first layer, the output (Eltwise4 of every model) the top of the last one
+    input_blob = net->layers().front()->tops[0];
+    output_blob = net->layers().back()->tops[0];
+
+    // the pipelines of a format, the float RGB ones read and write the frames between the passes of scale 4 and 8
+    const auto get_pipelines = [&](const int _bytes, const int _yuv, const bool _half)
+    {
+        std::weak_ptr<Pipelines>& shared = shared_pipelines[std::make_tuple(vkdev, fp32, tta_level, _bytes, _yuv, _half)];
+        std::shared_ptr<Pipelines> p = shared.lock();
+
+        if (p)
+            return p;
+
+        p = std::make_shared<Pipelines>();
+        p->opt = net->opt;
+
+        // initialize preprocess and postprocess pipeline
+        if (vkdev)
+        {
+            std::vector<ncnn::vk_specialization_type> specializations(4);
+#if _WIN32
+            specializations[0].i = 1;
+#else
+            specializations[0].i = 0;
+#endif
+            specializations[1].i = _bytes;
+            specializations[2].i = _yuv;
+            specializations[3].i = _half;
+
+            // the number of transforms of the tta shaders
+            if (tta_level > 1)
+                specializations.emplace_back().i = tta_level;
+
+            {
+                std::vector<uint32_t> spirv;
+                if (tta_level > 1)
+                    compile_shader("waifu2x_preproc_tta", waifu2x_preproc_tta_comp_data, sizeof(waifu2x_preproc_tta_comp_data), net->opt, spirv);
+                else
+                    compile_shader("waifu2x_preproc", waifu2x_preproc_comp_data, sizeof(waifu2x_preproc_comp_data), net->opt, spirv);
+
+                p->preproc = new ncnn::Pipeline(vkdev);
+                p->preproc->set_optimal_local_size_xyz(8, 8, 3);
+                p->preproc->create(spirv.data(), spirv.size() * 4, specializations);
+            }
+
+            {
+                std::vector<uint32_t> spirv;
+                if (tta_level > 1)
+                    compile_shader("waifu2x_postproc_tta", waifu2x_postproc_tta_comp_data, sizeof(waifu2x_postproc_tta_comp_data), net->opt, spirv);
+                else
+                    compile_shader("waifu2x_postproc", waifu2x_postproc_comp_data, sizeof(waifu2x_postproc_comp_data), net->opt, spirv);
+
+                p->postproc = new ncnn::Pipeline(vkdev);
+                p->postproc->set_optimal_local_size_xyz(8, 8, 3);
+                p->postproc->create(spirv.data(), spirv.size() * 4, specializations);
+            }
+        }
+
+        // bicubic 2x for alpha channel
+        {
+            p->bicubic_2x = ncnn::create_layer("Interp");
+            p->bicubic_2x->vkdev = vkdev;
+
+            ncnn::ParamDict pd;
+            pd.set(0, 3);// bicubic
+            pd.set(1, 2.f);
+            pd.set(2, 2.f);
+            p->bicubic_2x->load_param(pd);
+
+            p->bicubic_2x->create_pipeline(net->opt);
+        }
+
+        shared = p;
+        return p;
+    };
+
+    pipelines = get_pipelines(bytes, yuv, half);
+    rgb_pipelines = (vkdev && scale > 2) ? get_pipelines(4, 0, false) : nullptr;
+
+    waifu2x_preproc = pipelines->preproc;
+    waifu2x_postproc = pipelines->postproc;
+    bicubic_2x = pipelines->bicubic_2x;
+    rgb_preproc = rgb_pipelines ? rgb_pipelines->preproc : 0;
+    rgb_postproc = rgb_pipelines ? rgb_pipelines->postproc : 0;
+
+    return 0;
+}
+
+static double to_ms(const std::chrono::steady_clock::duration d)
+{
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+// FNV-1a
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= p[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+// a word at a time, fast enough for hashing every tile of every frame
+// each step is a bijection of the state, so a single changed word always changes the hash
+static uint64_t hash_words(uint64_t hash, const void* data, size_t size)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+
+    for (; size >= 8; p += 8, size -= 8)
+    {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+
+        hash = (hash ^ v) * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 29;
+    }
+
+    return hash_bytes(hash, p, size);
+}
+
+void Waifu2x::compile_shader(const char* name, const char* comp_data, int comp_data_size, const ncnn::Option& opt, std::vector<uint32_t>& spirv) const
+{
+    if (spirv_cache.empty())
+    {
+        compile_spirv_module(comp_data, comp_data_size, opt, spirv);
+        return;
+    }
+
+    // the file name changes with the shader source, the options that become macros, the device and driver
+    // and the ncnn version, which comes with the glslang it compiles with
+    const ncnn::GpuInfo& info = vkdev->info;
+    const uint32_t ids[3] = { info.vendor_id(), info.device_id(), info.driver_version() };
+    const bool flags[] = { opt.use_fp16_packed, opt.use_fp16_storage, opt.use_fp16_arithmetic, opt.use_int8_packed, opt.use_int8_storage,
+        opt.use_int8_arithmetic, opt.use_bf16_storage, opt.use_shader_pack8, opt.use_subgroup_basic, opt.use_image_storage, opt.use_tensor_storage };
+
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = hash_bytes(hash, comp_data, comp_data_size);
+    hash = hash_bytes(hash, ids, sizeof(ids));
+    hash = hash_bytes(hash, info.pipeline_cache_uuid(), 16);
+    hash = hash_bytes(hash, flags, sizeof(flags));
+    hash = hash_bytes(hash, NCNN_VERSION_STRING, sizeof(NCNN_VERSION_STRING));
+
+    char key[17];
+    snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(hash));
+
+    const std::filesystem::path path = spirv_cache / (std::string(name) + "-" + key + ".spv");
+
+    {
+        std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+        if (ifs)
+        {
+            const std::streamoff size = ifs.tellg();
+
+            // anything that isn't a whole SPIR-V module is compiled again
+            if (size > 0 && size % 4 == 0)
+            {
+                spirv.resize(static_cast<size_t>(size) / 4);
+                ifs.seekg(0);
+
+                if (ifs.read(reinterpret_cast<char*>(spirv.data()), size) && spirv[0] == 0x07230203)
+                    return;
+            }
+
+            spirv.clear();
+        }
+    }
+
+    compile_spirv_module(comp_data, comp_data_size, opt, spirv);
+
+    if (spirv.empty())
+        return;
+
+    // written under a temporary name first, so that concurrent jobs never read a partial file
+    // the name has the process id as the thread ids are only unique within a process
+    std::error_code ec;
+    std::filesystem::create_directories(spirv_cache, ec);
+
+#if _WIN32
+    const unsigned long pid = GetCurrentProcessId();
+#else
+    const unsigned long pid = static_cast<unsigned long>(getpid());
+#endif
+
+    std::filesystem::path tmp = path;
+    tmp += "." + std::to_string(pid) + "-" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+
+    {
+        std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
+        if (!ofs)
+            return;
+
+        ofs.write(reinterpret_cast<const char*>(spirv.data()), spirv.size() * 4);
+        if (!ofs)
+        {
+            ofs.close();
+            std::filesystem::remove(tmp, ec);
+            return;
+        }
+    }
+
+    std::filesystem::rename(tmp, path, ec);
+    if (ec)
+        std::filesystem::remove(tmp, ec);
+}
+
+void Waifu2x::init_format()
+{
+    // float planes are transferred as half precision when asked, the CPU backend has nothing to transfer
+    half = fp16_io && bits == 32 && vkdev;
+    bytes = half ? 2 : (bits == 32) ? 4 : (bits > 8) ? 2 : 1;
+    maxv = (bits == 32) ? 1 : (1 << bits) - 1;
+
+    switch (matrix)
+    {
+        case 5:
+        case 6:
+            kr = 0.299f;
+            kb = 0.114f;
+            break;
+        case 9:
+            kr = 0.2627f;
+            kb = 0.0593f;
+            break;
+        default:
+            kr = 0.2126f;
+            kb = 0.0722f;
+            break;
+    }
+
+    // raw = normalized * mul + add, chroma is normalized to -0.5..0.5
+    if (bits == 32)
+    {
+        ymul = 1.f;
+        yadd = 0.f;
+        cmul = 1.f;
+        cadd = 0.f;
+    }
+    else if (yuv == 0 || full_range)
+    {
+        ymul = static_cast<float>(maxv);
+        yadd = 0.f;
+        cmul = static_cast<float>(maxv);
+        cadd = static_cast<float>(1 << (bits - 1));
+    }
+    else
+    {
+        ymul = static_cast<float>(219 << (bits - 8));
+        yadd = static_cast<float>(16 << (bits - 8));
+        cmul = static_cast<float>(224 << (bits - 8));
+        cadd = static_cast<float>(128 << (bits - 8));
+    }
+}
+
+void Waifu2x::format_constants(ncnn::vk_constant_type* constants) const
+{
+    constants[0].f = kr;
+    constants[1].f = kb;
+    constants[2].f = ymul;
+    constants[3].f = yadd;
+    constants[4].f = cmul;
+    constants[5].f = cadd;
+}
+
+void Waifu2x::rgb_constants(ncnn::vk_constant_type* constants, const bool preproc) const
+{
+    // the postproc adds clip_eps to float RGB, the preproc of the next pass takes it off again
+    constexpr float clip_eps = 0.5f / 255.f;
+
+    constants[0].f = kr;
+    constants[1].f = kb;
+    constants[2].f = 1.f;
+    constants[3].f = preproc ? clip_eps : 0.f;
+    constants[4].f = 1.f;
+    constants[5].f = 0.f;
+}
+
+void Waifu2x::align_tiles()
+{
+    // the postproc writes whole 32-bit words, so every output tile must start on a word of each plane
+    const int sub = (yuv == 2) ? 2 : 1;
+    const int align = 4 / bytes * sub;
+
+    while ((tile_w * net_scale()) % align)
+        ++tile_w;
+    if (sub == 2 && scale == 1)
+        tile_h = (tile_h + 1) & ~1;
+}
+
+size_t Waifu2x::tile_memory(const int tw, const int th) const
+{
+    // a rough upper bound of the blobs alive while one tile goes through the network,
+    // the widest layers of the models have about 384 channels alive at the input resolution
+    const size_t elemsize = net->opt.use_fp16_storage ? 2 : 4;
+    const size_t in_w = tw + prepadding * 2 + 3;
+    const size_t in_h = th + prepadding * 2 + 3;
+    const size_t in_size = in_w * in_h * 3 * elemsize;
+    const size_t out_size = static_cast<size_t>(tw) * th * net_scale() * net_scale() * 3 * elemsize;
+
+    size_t size = in_w * in_h * 384 * elemsize + in_size + out_size;
+
+    // the transforms are alive until the postproc
+    size += (in_size + out_size) * (tta_level - 1);
+
+    return size;
+}
+
+void Waifu2x::autotune(const int w, const int h, const int tiles_in_flight, const size_t budget, const bool tune_w, const bool tune_h)
+{
+    struct Candidate
+    {
+        int tw;
+        int th;
+        double waste;
+    };
+
+    const int fixed_w = tile_w;
+    const int fixed_h = tile_h;
+
+    std::vector<Candidate> candidates;
+    Candidate smallest{ tile_w, tile_h, 0.0 };
+    size_t smallest_memory = SIZE_MAX;
+
+    // the float RGB frames between the passes of scale 4 and 8 stay in device memory next to the tiles
+    size_t frames_memory = 0;
+    for (int s = 2; s < scale; s *= 2)
+        frames_memory += static_cast<size_t>(w) * s * h * s * (alpha ? 4 : 3) * 4;
+
+    // and so do the input and output frames with whole_frame
+    if (whole_frame)
+        frames_memory += static_cast<size_t>(w) * h * (1 + scale * scale) * (alpha ? 4 : 3) * bytes;
+
+    const size_t tiles_budget = (budget > frames_memory) ? budget - frames_memory : 0;
+
+    const int max_nx = tune_w ? (std::max)(w / 32, 1) : 1;
+    const int max_ny = tune_h ? (std::max)(h / 32, 1) : 1;
+
+    for (int ny = 1; ny <= (std::min)(max_ny, 16); ++ny)
+    {
+        for (int nx = 1; nx <= (std::min)(max_nx, 16); ++nx)
+        {
+            tile_w = tune_w ? (std::max)((w + nx - 1) / nx, 32) : fixed_w;
+            tile_h = tune_h ? (std::max)((h + ny - 1) / ny, 32) : fixed_h;
+            align_tiles();
+
+            if (std::any_of(candidates.begin(), candidates.end(), [&](const Candidate& c) { return c.tw == tile_w && c.th == tile_h; }))
+                continue;
+
+            // share of the processed pixels that are prepadding
+            const int xtiles = (w + tile_w - 1) / tile_w;
+            const int ytiles = (h + tile_h - 1) / tile_h;
+            const double padded = static_cast<double>(w + xtiles * prepadding * 2) * (h + ytiles * prepadding * 2);
+            const Candidate c{ tile_w, tile_h, padded / (static_cast<double>(w) * h) };
+
+            const size_t memory = tile_memory(tile_w, tile_h) * tiles_in_flight;
+            if (memory < smallest_memory)
+            {
+                smallest = c;
+                smallest_memory = memory;
+            }
+
+            if (!vkdev || memory <= tiles_budget)
+                candidates.push_back(c);
+        }
+    }
+
+    if (candidates.empty())
+    {
+        tile_w = smallest.tw;
+        tile_h = smallest.th;
+        return;
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) { return a.waste < b.waste; });
+
+    // the CPU backend spreads the tiles over its threads, prefer the least padding that keeps them busy
+    if (!vkdev)
+    {
+        const auto it = std::find_if(candidates.begin(), candidates.end(), [&](const Candidate& c)
+            {
+                return static_cast<long long>((w + c.tw - 1) / c.tw) * ((h + c.th - 1) / c.th) >= num_threads;
+            });
+
+        const Candidate& c = (it != candidates.end()) ? *it : candidates.back();
+        tile_w = c.tw;
+        tile_h = c.th;
+        return;
+    }
+
+    // the least padded sizes are mostly the largest tiles that fit, so the least padded candidate of every tile count
+    // (1, 2, 3-4, 5-8, ...) is timed instead, at most five of them spread over the classes
+    std::vector<Candidate> classes;
+    std::vector<int> class_ids;
+    for (const Candidate& c : candidates)
+    {
+        const long long tiles = static_cast<long long>((w + c.tw - 1) / c.tw) * ((h + c.th - 1) / c.th);
+        int id = 0;
+        while ((1ll << id) < tiles)
+            ++id;
+
+        if (std::find(class_ids.begin(), class_ids.end(), id) == class_ids.end())
+        {
+            class_ids.push_back(id);
+            classes.push_back(c);
+        }
+    }
+
+    std::vector<Candidate> timed;
+    for (size_t i = 0; i < (std::min)(classes.size(), static_cast<size_t>(5)); ++i)
+        timed.push_back(classes[(classes.size() <= 5) ? i : i * (classes.size() - 1) / 4]);
+
+    // benchmark them on a blank frame
+    std::vector<uint8_t> src[4];
+    std::vector<uint8_t> dst[4];
+    Frame frame;
+    blank_frame(w, h, src, dst, frame);
+
+    double best_time = 0.0;
+    Candidate best = timed[0];
+
+    // the blank frame would come from the tile cache the second time
+    const size_t cache_size = tile_cache_size;
+    tile_cache_size = 0;
+
+    for (size_t i = 0; i < timed.size(); ++i)
+    {
+        tile_w = timed[i].tw;
+        tile_h = timed[i].th;
+
+        // every size starts with new contexts, the memory of the previous ones isn't kept
+        context_pool->idle.clear();
+        context_pool->contexts.clear();
+
+        // the first run creates the allocations and pipelines
+        process(&frame, 1, w, h);
+
+        const auto start = std::chrono::steady_clock::now();
+        process(&frame, 1, w, h);
+        const double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (i == 0 || time < best_time)
+        {
+            best_time = time;
+            best = timed[i];
+        }
+    }
+
+    tile_cache_size = cache_size;
+    tile_w = best.tw;
+    tile_h = best.th;
+
+    context_pool->idle.clear();
+    context_pool->contexts.clear();
+}
+
+void Waifu2x::warmup(const int w, const int h, const int contexts)
+{
+    // the chroma of 4:2:0 is subsampled
+    const int sub = (yuv == 2) ? 2 : 1;
+    const int fw = (std::max)(w / sub * sub, sub);
+    const int fh = (std::max)(h / sub * sub, sub);
+
+    // the blank tiles would come from the tile cache
+    const size_t cache_size = tile_cache_size;
+    tile_cache_size = 0;
+
+    // the calls run at the same time, so that every one of them creates a context, the CPU backend has none
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < (vkdev ? (std::max)(contexts, 1) : 1); ++i)
+    {
+        threads.emplace_back([this, fw, fh]()
+            {
+                std::vector<uint8_t> src[4];
+                std::vector<uint8_t> dst[4];
+                Frame frame;
+                blank_frame(fw, fh, src, dst, frame);
+
+                process(&frame, 1, fw, fh);
+            });
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    tile_cache_size = cache_size;
+}
+
+void Waifu2x::blank_frame(const int w, const int h, std::vector<uint8_t>* src, std::vector<uint8_t>* dst, Frame& frame) const
+{
+    const int sub = (yuv == 2) ? 2 : 1;
+    const int src_bytes = (bits == 32) ? 4 : bytes;
+    const ptrdiff_t stride = (w + 63) / 64 * 64;
+    const ptrdiff_t dst_stride = (w * scale + 63) / 64 * 64;
+
+    for (int q = 0; q < (alpha ? 4 : 3); ++q)
+    {
+        const int s = (q > 0) ? sub : 1;
+
+        src[q].assign(stride / s * (h / s) * src_bytes, 0);
+        dst[q].assign(dst_stride / s * (h * scale / s) * src_bytes, 0);
+
+        frame.src[q] = src[q].data();
+        frame.dst[q] = dst[q].data();
+        frame.srcStride[q] = stride / s;
+        frame.dstStride[q] = dst_stride / s;
+    }
+}
+
+int Waifu2x::process(const float* srcR, const float* srcG, const float* srcB,
+    float* dstR, float* dstG, float* dstB,
+    const int w, const int h, const ptrdiff_t srcStride, const ptrdiff_t dstStride) const
+{
+    const Frame frame{ { srcR, srcG, srcB }, { dstR, dstG, dstB }, { srcStride, srcStride, srcStride }, { dstStride, dstStride, dstStride } };
+
+    return process(&frame, 1, w, h);
+}
+
+int Waifu2x::process(const Frame* frames, const int count, const int w, const int h, Stats* stats) const
+{
+    if (stats)
+        *stats = Stats{};
+
+    if (!vkdev)
+        return process_cpu(frames, count, w, h, stats);
+
+    Context* ctx = acquire_context();
+
+    if (scale <= 2)
+    {
+        process_pass(frames, count, w, h, nullptr, nullptr, *ctx, stats);
+    }
+    else
+    {
+        // the first pass reads the planes and the last one writes them,
+        // the frames in between are float RGB in device memory and never go through the host
+        const int passes = (scale == 8) ? 3 : 2;
+
+        std::vector<ncnn::VkMat> src_gpu;
+        std::vector<ncnn::VkMat> dst_gpu;
+
+        for (int pass = 0; pass < passes; ++pass)
+        {
+            const int pw = w << pass;
+            const int ph = h << pass;
+
+            if (pass < passes - 1)
+            {
+                dst_gpu.resize(count);
+                for (int f = 0; f < count; ++f)
+                    dst_gpu[f].create(pw * 2, ph * 2, alpha ? 4 : 3, 4u, 1, &ctx->blob_allocator);
+            }
+
+            process_pass(frames, count, pw, ph, pass > 0 ? &src_gpu : nullptr, pass < passes - 1 ? &dst_gpu : nullptr, *ctx, stats);
+
+            src_gpu.swap(dst_gpu);
+            dst_gpu.clear();
+        }
+    }
+
+    if (stats)
+        stats->memory = ctx->blob_allocator.peak;
+
+    release_context(ctx);
+
+    return 0;
+}
+
+Waifu2x::Context* Waifu2x::acquire_context() const
+{
+    {
+        ncnn::MutexLockGuard guard(context_pool->lock);
+
+        if (!context_pool->idle.empty())
+        {
+            Context* ctx = context_pool->idle.back();
+            context_pool->idle.pop_back();
+            return ctx;
+        }
+    }
+
+    auto ctx = std::make_unique<Context>(vkdev);
+
+    ctx->opt = net->opt;
+    ctx->opt.blob_vkallocator = &ctx->blob_allocator;
+    ctx->opt.workspace_vkallocator = &ctx->blob_allocator;
+    ctx->opt.staging_vkallocator = &ctx->staging_allocator;
+
+    ncnn::MutexLockGuard guard(context_pool->lock);
+
+    context_pool->contexts.push_back(std::move(ctx));
+    return context_pool->contexts.back().get();
+}
+
+void Waifu2x::release_context(Context* ctx) const
+{
+    ncnn::MutexLockGuard guard(context_pool->lock);
+
+    context_pool->idle.push_back(ctx);
+}
+
+size_t Waifu2x::peak_memory() const
+{
+    ncnn::MutexLockGuard guard(context_pool->lock);
+
+    size_t peak = 0;
+    for (const auto& ctx : context_pool->contexts)
+        peak += ctx->blob_allocator.peak;
+
+    return peak;
+}
+
+void Waifu2x::process_pass(const Frame* frames, const int count, const int w, const int h,
+    const std::vector<ncnn::VkMat>* src_gpu, const std::vector<ncnn::VkMat>* dst_gpu, Context& ctx, Stats* stats) const
+{
+    const int channels = alpha ? 4 : 3;
+
+    const int TILE_SIZE_Y = tile_h;
+    const int pass_scale = net_scale();
+
+    const ncnn::Option& opt = ctx.opt;
+    ncnn::VkAllocator* blob_vkallocator = opt.blob_vkallocator;
+    ncnn::VkAllocator* staging_vkallocator = opt.staging_vkallocator;
+
+    const int xtiles = (w + tile_w - 1) / tile_w;
+    const int ytiles = (h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
+
+    // the float RGB frames of the other passes of scale 4 and 8 are always whole, so are the planes with whole_frame
+    const Pass pass{ src_gpu != nullptr, dst_gpu != nullptr, src_gpu || whole_frame, dst_gpu || whole_frame };
+
+    // with the tile cache the tiles of a row whose input was seen before are skipped on the GPU
+    // and written from the cache after the row is copied out, the others are added to the cache then
+    // the tiles of scale 4 and 8 don't map to the input planes and whole frames are copied out after the last row, so they aren't cached
+    const bool reuse = tile_cache_size > 0 && !pass.whole_in && !pass.whole_out;
+    std::vector<uint64_t> row_keys[2];
+    std::vector<std::vector<uint8_t>> row_inputs[2];
+    std::vector<TileCache::Tile> row_hits[2];
+    std::vector<bool> row_skip[2];
+    bool row_gpu[2] = {};
+
+    // the tile rows are pipelined: while row yi is processed on the context's worker thread,
+    // the host gathers row yi + 1 and scatters row yi - 1
+    // the same row of every frame in the batch goes into a single submission
+    // the staging buffers of a row are allocated and released on this thread, the worker's extractors have a staging allocator of their own
+    std::vector<ncnn::VkMat> row_ins[2];
+    std::vector<ncnn::VkMat> row_outs[2];
+
+    // copies rows y0 to y1 of the planes into staging memory, the preproc shader reads them from there
+    const auto upload = [&](ncnn::VkMat& in_gpu, const Frame& frame, const int y0, const int y1)
+    {
+        // 4:2:0 chroma rows needed by the bilinear upsampling in the preproc shader
+        const int chroma_y0 = (std::max)(y0 / 2 - 1, 0);
+        const int chroma_y1 = (std::min)((y1 - 1) / 2 + 2, h / 2);
+
+        // the integer formats are uploaded as they are, the shaders unpack the components from 32-bit words
+        in_gpu.create(static_cast<int>(frame.srcStride[0]), y1 - y0, channels, (size_t)bytes, 1, staging_vkallocator);
+
+        ncnn::Mat in = in_gpu.mapped();
+
+        for (int q = 0; q < channels; ++q)
+        {
+            const ptrdiff_t srcStride = frame.srcStride[q];
+            const int row0 = (yuv == 2 && q > 0) ? chroma_y0 : y0;
+            const int rows = (yuv == 2 && q > 0) ? chroma_y1 - chroma_y0 : in.h;
+            const int width = (yuv == 2 && q > 0) ? w / 2 : w;
+
+            const ptrdiff_t offset = row0 * srcStride;
+            const size_t n = (rows - 1) * srcStride + width;
+
+            if (half)
+                float_to_half(static_cast<const float*>(frame.src[q]) + offset, in.channel(q), n);
+            else
+                std::memcpy(in.channel(q), static_cast<const uint8_t*>(frame.src[q]) + offset * bytes, n * bytes);
+        }
+
+        if (!in_gpu.allocator->coherent)
+            in_gpu.allocator->flush(in_gpu.data);
+
+        in_gpu.data->access_flags = VK_ACCESS_HOST_WRITE_BIT;
+        in_gpu.data->stage_flags = VK_PIPELINE_STAGE_HOST_BIT;
+    };
+
+    // copies staging memory holding the output rows from y0 on into the planes
+    const auto download = [&](const ncnn::VkMat& out_gpu, const Frame& frame, const int y0)
+    {
+        if (!out_gpu.allocator->coherent)
+            out_gpu.allocator->invalidate(out_gpu.data);
+
+        const ncnn::Mat out = out_gpu.mapped();
+
+        // the staging rows already have the stride of the destination plane
+        for (int q = 0; q < channels; ++q)
+        {
+            const int sub = (yuv == 2 && q > 0) ? 2 : 1;
+            const ptrdiff_t dstStride = frame.dstStride[q];
+
+            const ptrdiff_t offset = y0 / sub * dstStride;
+            const size_t n = (out.h / sub - 1) * dstStride + w * pass_scale / sub;
+
+            if (half)
+                half_to_float(out.channel(q), static_cast<float*>(frame.dst[q]) + offset, n);
+            else
+                std::memcpy(static_cast<uint8_t*>(frame.dst[q]) + offset * bytes, out.channel(q), n * bytes);
+        }
+    };
+
+    // whole_frame: the planes are uploaded once and copied into device memory where every tile is cropped from,
+    // the tiles are written into one device frame copied back and downloaded after the last row
+    std::vector<ncnn::VkMat> whole_ins;
+    std::vector<ncnn::VkMat> whole_outs;
+
+    if (whole_frame && (!src_gpu || !dst_gpu))
+    {
+        const auto upload_start = std::chrono::steady_clock::now();
+
+        ncnn::VkCompute& cmd = ctx.cmd;
+
+        // the staging frames have to live until the copies are done
+        std::vector<ncnn::VkMat> staging;
+
+        if (!src_gpu)
+        {
+            whole_ins.resize(count);
+            staging.resize(count);
+
+            for (int f = 0; f < count; ++f)
+            {
+                upload(staging[f], frames[f], 0, h);
+                cmd.record_clone(staging[f], whole_ins[f], opt);
+            }
+        }
+
+        if (!dst_gpu)
+        {
+            whole_outs.resize(count);
+
+            for (int f = 0; f < count; ++f)
+                whole_outs[f].create(static_cast<int>(frames[f].dstStride[0]), h * pass_scale, channels, (size_t)bytes, 1, blob_vkallocator);
+        }
+
+        if (stats)
+            stats->upload += to_ms(std::chrono::steady_clock::now() - upload_start);
+
+        const auto submit_start = std::chrono::steady_clock::now();
+
+        cmd.submit_and_wait();
+        cmd.reset();
+
+        if (stats)
+            stats->gpu += to_ms(std::chrono::steady_clock::now() - submit_start);
+    }
+
+    const auto scatter = [&](const int yi)
+    {
+        const auto start = std::chrono::steady_clock::now();
+
+        const std::vector<ncnn::VkMat>& outs = row_outs[yi % 2];
+
+        for (int f = 0; row_gpu[yi % 2] && !pass.whole_out && f < count; ++f)
+            download(outs[f], frames[f], yi * pass_scale * TILE_SIZE_Y);
+
+        for (int i = 0; reuse && i < count * xtiles; ++i)
+        {
+            const TileCache::Tile& hit = row_hits[yi % 2][i];
+
+            if (hit)
+            {
+                copy_tile(frames[i / xtiles], nullptr, hit.get(), i % xtiles, yi, w, h);
+            }
+            else
+            {
+                auto tile = std::make_shared<std::vector<uint8_t>>();
+                copy_tile(frames[i / xtiles], tile.get(), nullptr, i % xtiles, yi, w, h);
+                tile_cache->insert(row_keys[yi % 2][i], std::move(row_inputs[yi % 2][i]), std::move(tile), tile_cache_size);
+            }
+        }
+
+        if (stats)
+            stats->download += to_ms(std::chrono::steady_clock::now() - start);
+    };
+
+    for (int yi = 0; yi < ytiles; ++yi)
+    {
+        const int tile_h_nopad = (std::min)((yi + 1) * TILE_SIZE_Y, h) - yi * TILE_SIZE_Y;
+
+        int prepadding_bottom = prepadding;
+        if (pass_scale == 1)
+        {
+            prepadding_bottom += (tile_h_nopad + 3) / 4 * 4 - tile_h_nopad;
+        }
+        if (pass_scale == 2)
+        {
+            prepadding_bottom += (tile_h_nopad + 1) / 2 * 2 - tile_h_nopad;
+        }
+
+        int in_tile_y0 = (std::max)(yi * TILE_SIZE_Y - prepadding, 0);
+        int in_tile_y1 = (std::min)((yi + 1) * TILE_SIZE_Y + prepadding_bottom, h);
+
+        int out_tile_y0 = (std::max)(yi * TILE_SIZE_Y, 0);
+        int out_tile_y1 = (std::min)((yi + 1) * TILE_SIZE_Y, h);
+
+        std::vector<ncnn::VkMat>& ins = row_ins[yi % 2];
+        std::vector<ncnn::VkMat>& outs = row_outs[yi % 2];
+        ins.resize(count);
+        outs.resize(count);
+
+        const auto upload_start = std::chrono::steady_clock::now();
+
+        std::vector<bool>& skip = row_skip[yi % 2];
+        skip.clear();
+
+        if (reuse)
+        {
+            std::vector<uint64_t>& keys = row_keys[yi % 2];
+            std::vector<std::vector<uint8_t>>& inputs = row_inputs[yi % 2];
+            std::vector<TileCache::Tile>& hits = row_hits[yi % 2];
+            keys.resize(count * xtiles);
+            inputs.resize(count * xtiles);
+            hits.resize(count * xtiles);
+            skip.resize(count * xtiles);
+
+            for (int i = 0; i < count * xtiles; ++i)
+            {
+                inputs[i].clear();
+                keys[i] = tile_key(frames[i / xtiles], &inputs[i], i % xtiles, yi, w, h);
+                hits[i] = tile_cache->find(keys[i], inputs[i]);
+                skip[i] = hits[i] != nullptr;
+            }
+
+            if (stats)
+            {
+                stats->tiles += count * xtiles;
+                stats->reused += static_cast<int>(std::count(skip.begin(), skip.end(), true));
+            }
+        }
+        else if (stats)
+        {
+            stats->tiles += count * xtiles;
+        }
+
+        // a row without a tile to process isn't uploaded at all
+        row_gpu[yi % 2] = std::find(skip.begin(), skip.end(), false) != skip.end() || skip.empty();
+
+        for (int f = 0; row_gpu[yi % 2] && f < count; ++f)
+        {
+            // the whole frames are bound as they are, the tiles are cropped from them on the GPU
+            if (dst_gpu)
+                outs[f] = (*dst_gpu)[f];
+            else if (whole_frame)
+                outs[f] = whole_outs[f];
+            else
+                outs[f].create(static_cast<int>(frames[f].dstStride[0]), (out_tile_y1 - out_tile_y0) * pass_scale, channels, (size_t)bytes, 1, staging_vkallocator);
+
+            if (src_gpu)
+                ins[f] = (*src_gpu)[f];
+            else if (whole_frame)
+                ins[f] = whole_ins[f];
+            else
+                upload(ins[f], frames[f], in_tile_y0, in_tile_y1);
+        }
+
+        if (stats)
+            stats->upload += to_ms(std::chrono::steady_clock::now() - upload_start);
+
+        ctx.worker.wait();
+
+        if (row_gpu[yi % 2])
+        {
+            ctx.worker.submit([this, frames, &ins, &outs, &skip, yi, w, h, prepadding_bottom, &pass, &ctx, stats]()
+                {
+                    process_row(frames, ins, outs, skip, yi, w, h, prepadding_bottom, pass, ctx, stats);
+                });
+        }
+
+        if (yi > 0)
+            scatter(yi - 1);
+    }
+
+    ctx.worker.wait();
+
+    scatter(ytiles - 1);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        row_ins[i].clear();
+        row_outs[i].clear();
+    }
+
+    if (!whole_outs.empty())
+    {
+        const auto submit_start = std::chrono::steady_clock::now();
+
+        ncnn::Option staging_opt = opt;
+        staging_opt.blob_vkallocator = staging_vkallocator;
+
+        ncnn::VkCompute& cmd = ctx.cmd;
+
+        std::vector<ncnn::VkMat> staging(count);
+        for (int f = 0; f < count; ++f)
+            cmd.record_clone(whole_outs[f], staging[f], staging_opt);
+
+        cmd.submit_and_wait();
+        cmd.reset();
 
-    net.opt.num_threads = num_threads;
+        const auto download_start = std::chrono::steady_clock::now();
 
-    waifu2x_preproc = 0;
-    waifu2x_postproc = 0;
-    bicubic_2x = 0;
-    tta_mode = _tta_mode;
+        for (int f = 0; f < count; ++f)
+            download(staging[f], frames[f], 0);
+
+        if (stats)
+        {
+            stats->gpu += to_ms(download_start - submit_start);
+            stats->download += to_ms(std::chrono::steady_clock::now() - download_start);
+        }
+    }
 }
 
-Waifu2x::~Waifu2x()
+void Waifu2x::process_row(const Frame* frames, const std::vector<ncnn::VkMat>& in_gpu, const std::vector<ncnn::VkMat>& out_gpu, const std::vector<bool>& skip,
+    const int yi, const int w, const int h, const int prepadding_bottom, const Pass& pass, Context& ctx, Stats* stats) const
 {
-    // cleanup preprocess and postprocess pipeline
-    {
-        delete waifu2x_preproc;
-        delete waifu2x_postproc;
-    }
+    const int TILE_SIZE_X = tile_w;
 
-    bicubic_2x->destroy_pipeline(net.opt);
-    delete bicubic_2x;
-}
+    const int count = static_cast<int>(in_gpu.size());
 
-#if _WIN32
-int Waifu2x::load(const std::wstring& parampath, const std::wstring& modelpath, const bool fp32)
+    // each tile 400x400
+    const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
+
+    // the calling thread allocates the next row from the other staging allocator meanwhile
+    ncnn::Option opt = ctx.opt;
+    opt.staging_vkallocator = &ctx.row_staging_allocator;
+
+    ncnn::VkCompute& cmd = ctx.row_cmd;
+
+#if NCNN_BENCHMARK
+    // a query pool is only reset when it's created, so every timed submission gets its own command
+    std::unique_ptr<ncnn::VkCompute> timed_cmd;
+    if (stats)
+    {
+        timed_cmd = std::make_unique<ncnn::VkCompute>(vkdev);
+        timed_cmd->create_query_pool(count * xtiles * 4);
+    }
+    ncnn::VkCompute& c = timed_cmd ? *timed_cmd : cmd;
 #else
-int Waifu2x::load(const std::string& parampath, const std::string& modelpath, const bool fp32)
+    ncnn::VkCompute& c = cmd;
 #endif
-{
-    net.opt.use_vulkan_compute = vkdev ? true : false;
-    net.opt.use_fp16_packed = !fp32;
-    net.opt.use_fp16_storage = !fp32;
-    net.opt.use_fp16_arithmetic = false;
-    net.opt.use_int8_storage = false;
 
-    net.set_vulkan_device(vkdev);
+    const auto record_start = std::chrono::steady_clock::now();
 
-#if _WIN32
+    // the whole row goes into one submission, the postproc shader writes straight into the staging memory of out_gpu
+    // the tiles taken from the tile cache are skipped
+    int recorded = 0;
+    for (int xi = 0; xi < xtiles; ++xi)
     {
-        FILE* fp = _wfopen(parampath.c_str(), L"rb");
-        if (!fp)
-            fwprintf(stderr, L"_wfopen %ls failed\n", parampath.c_str());
-
-        net.load_param(fp);
+        for (int f = 0; f < count; ++f)
+        {
+            if (!skip.empty() && skip[f * xtiles + xi])
+                continue;
 
-        fclose(fp);
+            record_tile(c, frames[f], in_gpu[f], out_gpu[f], xi, yi, w, h, prepadding_bottom, pass, opt, stats ? recorded * 4 : -1);
+            ++recorded;
+        }
     }
+
+    if (recorded == 0)
+        return;
+
+    const auto submit_start = std::chrono::steady_clock::now();
+
+    c.submit_and_wait();
+
+    if (stats)
     {
-        FILE* fp = _wfopen(modelpath.c_str(), L"rb");
-        if (!fp)
-            fwprintf(stderr, L"_wfopen %ls failed\n", modelpath.c_str());
+        const auto submit_end = std::chrono::steady_clock::now();
 
-        net.load_model(fp);
+        stats->record += to_ms(submit_start - record_start);
+        stats->gpu += to_ms(submit_end - submit_start);
 
-        fclose(fp);
-    }
-#else
-    net.load_param(parampath.c_str());
-    net.load_model(modelpath.c_str());
+#if NCNN_BENCHMARK
+        std::vector<uint64_t> results(recorded * 4);
+        if (c.get_query_pool_results(0, recorded * 4, results) == 0)
+        {
+            // ticks to milliseconds
+            const double period = vkdev->info.timestamp_period() / 1e6;
+
+            for (int f = 0; f < recorded; ++f)
+            {
+                stats->preproc += (results[f * 4 + 1] - results[f * 4]) * period;
+                stats->infer += (results[f * 4 + 2] - results[f * 4 + 1]) * period;
+                stats->postproc += (results[f * 4 + 3] - results[f * 4 + 2]) * period;
+            }
+        }
 #endif
+    }
+
+    c.reset();
+}
 
-    // initialize preprocess and postprocess pipeline
-    if (vkdev)
+void Waifu2x::record_tile(ncnn::VkCompute& cmd, const Frame& frame, const ncnn::VkMat& in_gpu, const ncnn::VkMat& out_gpu, const int xi, const int yi,
+    const int w, const int h, const int prepadding_bottom, const Pass& pass, const ncnn::Option& opt, [[maybe_unused]] const int query) const
+{
+    // GPU timestamps around the stages of this tile, only with a benchmark build of ncnn
+    const auto timestamp = [&]([[maybe_unused]] const int i)
     {
-        std::vector<ncnn::vk_specialization_type> specializations(1);
-#if _WIN32
-        specializations[0].i = 1;
-#else
-        specializations[0].i = 0;
+#if NCNN_BENCHMARK
+        if (query >= 0)
+            cmd.record_write_timestamp(query + i);
 #endif
+    };
+
+    const int channels = alpha ? 4 : 3;
+
+    const int TILE_SIZE_X = tile_w;
+    const int TILE_SIZE_Y = tile_h;
+    const int pass_scale = net_scale();
+
+    // in_y0 and out_y0 are the first rows of the tile row in in_gpu and out_gpu
+    const ncnn::Pipeline* preproc = pass.rgb_in ? rgb_preproc : waifu2x_preproc;
+    const ncnn::Pipeline* postproc = pass.rgb_out ? rgb_postproc : waifu2x_postproc;
+    const int in_y0 = pass.whole_in ? 0 : (std::max)(yi * TILE_SIZE_Y - prepadding, 0);
+    const int in_stride = pass.rgb_in ? in_gpu.w : static_cast<int>(frame.srcStride[0]);
+    const int in_uvstride = pass.rgb_in ? in_gpu.w : static_cast<int>(frame.srcStride[1]);
+    const int out_stride = pass.rgb_out ? out_gpu.w : static_cast<int>(frame.dstStride[0]);
+    const int out_uvstride = pass.rgb_out ? out_gpu.w : static_cast<int>(frame.dstStride[1]);
+    const int out_y0 = pass.whole_out ? yi * TILE_SIZE_Y * pass_scale : 0;
+    const int out_h = ((std::min)((yi + 1) * TILE_SIZE_Y, h) - yi * TILE_SIZE_Y) * pass_scale;
+    const int out_bytes = pass.rgb_out ? 4 : bytes;
+
+    ncnn::VkAllocator* blob_vkallocator = opt.blob_vkallocator;
+    ncnn::VkAllocator* staging_vkallocator = opt.staging_vkallocator;
+
+    const size_t in_out_tile_elemsize = opt.use_fp16_storage ? 2u : 4u;
+
+    const int tile_w_nopad = (std::min)((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X;
+
+    int prepadding_right = prepadding;
+    if (pass_scale == 1)
+    {
+        prepadding_right += (tile_w_nopad + 3) / 4 * 4 - tile_w_nopad;
+    }
+    if (pass_scale == 2)
+    {
+        prepadding_right += (tile_w_nopad + 1) / 2 * 2 - tile_w_nopad;
+    }
+
+    // the alpha of the tile without the prepadding, written by the preproc and upscaled by bicubic_2x next to the network
+    const int tile_h_nopad = (std::min)((yi + 1) * TILE_SIZE_Y, h) - yi * TILE_SIZE_Y;
+
+    ncnn::VkMat in_alpha_tile_gpu;
+    if (alpha)
+        in_alpha_tile_gpu.create(tile_w_nopad, tile_h_nopad, 1, in_out_tile_elemsize, 1, blob_vkallocator);
 
+    timestamp(0);
+
+    if (tta_level > 1)
+    {
+        // crop tile
+        const int tile_x0 = xi * TILE_SIZE_X - prepadding;
+        const int tile_x1 = (std::min)((xi + 1) * TILE_SIZE_X, w) + prepadding_right;
+        const int tile_y0 = yi * TILE_SIZE_Y - prepadding;
+        const int tile_y1 = (std::min)((yi + 1) * TILE_SIZE_Y, h) + prepadding_bottom;
+        const int in_tile_w = tile_x1 - tile_x0;
+        const int in_tile_h = tile_y1 - tile_y0;
+
+        // with stack_tta the transforms of the same shape are stacked vertically and go through the network as one blob,
+        // 0-3 are in_tile_w x in_tile_h and 4-7 in_tile_h x in_tile_w
+        const bool stacked = stack_tta && tta_stackable;
+        const int stack0 = (std::min)(tta_level, 4);
+        const int stack1 = tta_level - stack0;
+
+        // preproc, only the first tta_level transforms are written
+        ncnn::VkMat in_tile_gpu[8];
         {
-            std::vector<uint32_t> spirv;
-            static ncnn::Mutex lock;
+            if (stacked)
+            {
+                in_tile_gpu[0].create(in_tile_w, in_tile_h * stack0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+                if (stack1)
+                    in_tile_gpu[4].create(in_tile_h, in_tile_w * stack1, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+
+                for (int ti = 1; ti < tta_level; ++ti)
+                    in_tile_gpu[ti] = in_tile_gpu[ti < 4 ? 0 : 4];
+            }
+            else
             {
-                ncnn::MutexLockGuard guard(lock);
-                if (spirv.empty())
+                for (int ti = 0; ti < tta_level; ++ti)
                 {
-                    if (tta_mode)
-                        compile_spirv_module(waifu2x_preproc_tta_comp_data, sizeof(waifu2x_preproc_tta_comp_data), net.opt, spirv);
+                    if (ti < 4)
+                        in_tile_gpu[ti].create(in_tile_w, in_tile_h, 3, in_out_tile_elemsize, 1, blob_vkallocator);
                     else
-                        compile_spirv_module(waifu2x_preproc_comp_data, sizeof(waifu2x_preproc_comp_data), net.opt, spirv);
+                        in_tile_gpu[ti].create(in_tile_h, in_tile_w, 3, in_out_tile_elemsize, 1, blob_vkallocator);
                 }
             }
 
-            waifu2x_preproc = new ncnn::Pipeline(vkdev);
-            waifu2x_preproc->set_optimal_local_size_xyz(8, 8, 3);
-            waifu2x_preproc->create(spirv.data(), spirv.size() * 4, specializations);
+            std::vector<ncnn::VkMat> bindings(10);
+            bindings[0] = in_gpu;
+            bindings[1] = in_tile_gpu[0];
+            bindings[2] = in_tile_gpu[1];
+            bindings[3] = in_tile_gpu[2];
+            bindings[4] = in_tile_gpu[3];
+            bindings[5] = in_tile_gpu[4];
+            bindings[6] = in_tile_gpu[5];
+            bindings[7] = in_tile_gpu[6];
+            bindings[8] = in_tile_gpu[7];
+            bindings[9] = in_alpha_tile_gpu;
+
+            std::vector<ncnn::vk_constant_type> constants(27);
+            constants[0].i = w;
+            constants[1].i = in_gpu.h;
+            constants[2].i = in_gpu.cstep;
+            constants[3].i = in_tile_w;
+            constants[4].i = in_tile_h;
+            constants[5].i = in_tile_gpu[0].cstep;
+            constants[6].i = prepadding;
+            constants[7].i = prepadding;
+            constants[8].i = xi * TILE_SIZE_X;
+            constants[9].i = yi * TILE_SIZE_Y - in_y0;
+            constants[10].i = channels;
+            constants[11].i = in_alpha_tile_gpu.w;
+            constants[12].i = in_alpha_tile_gpu.h;
+            constants[13].i = in_stride;
+            constants[14].i = in_uvstride;
+            constants[15].i = in_y0;
+            constants[16].i = (std::max)(in_y0 / 2 - 1, 0);
+            constants[17].i = w / 2;
+            constants[18].i = h / 2;
+            if (pass.rgb_in)
+                rgb_constants(&constants[19], true);
+            else
+                format_constants(&constants[19]);
+            constants[25].i = (tta_level == 8) ? in_tile_gpu[4].cstep : in_tile_gpu[0].cstep;
+            constants[26].i = stacked ? in_tile_w * in_tile_h : 0;
+
+            ncnn::VkMat dispatcher;
+            dispatcher.w = in_tile_w;
+            dispatcher.h = in_tile_h;
+            dispatcher.c = channels;
+
+            cmd.record_pipeline(preproc, bindings, constants, dispatcher);
         }
 
+        timestamp(1);
+
+        // waifu2x, once per stack or once per transform
+        ncnn::VkMat out_tile_gpu[8];
+        for (int ti = 0; ti < tta_level; ti += stacked ? 4 : 1)
         {
-            std::vector<uint32_t> spirv;
-            static ncnn::Mutex lock;
-            {
-                ncnn::MutexLockGuard guard(lock);
-                if (spirv.empty())
-                {
-                    if (tta_mode)
-                        compile_spirv_module(waifu2x_postproc_tta_comp_data, sizeof(waifu2x_postproc_tta_comp_data), net.opt, spirv);
-                    else
-                        compile_spirv_module(waifu2x_postproc_comp_data, sizeof(waifu2x_postproc_comp_data), net.opt, spirv);
-                }
-            }
+            ncnn::Extractor ex = net->create_extractor();
+
+            ex.set_blob_vkallocator(blob_vkallocator);
+            ex.set_workspace_vkallocator(blob_vkallocator);
+            ex.set_staging_vkallocator(staging_vkallocator);
 
-            waifu2x_postproc = new ncnn::Pipeline(vkdev);
-            waifu2x_postproc->set_optimal_local_size_xyz(8, 8, 3);
-            waifu2x_postproc->create(spirv.data(), spirv.size() * 4, specializations);
+            ex.input(input_blob, in_tile_gpu[ti]);
+
+            ex.extract(output_blob, out_tile_gpu[ti], cmd);
         }
-    }
 
-    // bicubic 2x for alpha channel
+        // the transforms of a stack are in_tile_h * pass_scale (in_tile_w * pass_scale) rows apart in the output
+        int out_tile_h = out_tile_gpu[0].h;
+        int voffset0 = 0;
+        int voffset1 = 0;
+
+        if (stacked)
+        {
+            out_tile_h -= (stack0 - 1) * in_tile_h * pass_scale;
+            voffset0 = in_tile_h * pass_scale * out_tile_gpu[0].w;
+            voffset1 = stack1 ? in_tile_w * pass_scale * out_tile_gpu[4].w : 0;
+
+            for (int ti = 1; ti < tta_level; ++ti)
+                out_tile_gpu[ti] = out_tile_gpu[ti < 4 ? 0 : 4];
+        }
+
+        ncnn::VkMat out_alpha_tile_gpu;
+        if (alpha && pass_scale == 1)
+            out_alpha_tile_gpu = in_alpha_tile_gpu;
+        else if (alpha)
+            bicubic_2x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
+
+        timestamp(2);
+
+        // postproc
+        {
+            std::vector<ncnn::VkMat> bindings(10);
+            bindings[0] = out_tile_gpu[0];
+            bindings[1] = out_tile_gpu[1];
+            bindings[2] = out_tile_gpu[2];
+            bindings[3] = out_tile_gpu[3];
+            bindings[4] = out_tile_gpu[4];
+            bindings[5] = out_tile_gpu[5];
+            bindings[6] = out_tile_gpu[6];
+            bindings[7] = out_tile_gpu[7];
+            bindings[8] = out_alpha_tile_gpu;
+            bindings[9] = out_gpu;
+
+            std::vector<ncnn::vk_constant_type> constants(25);
+            constants[0].i = out_tile_gpu[0].w;
+            constants[1].i = out_tile_h;
+            constants[2].i = out_tile_gpu[0].cstep;
+            constants[3].i = w * pass_scale;
+            constants[4].i = out_h;
+            constants[5].i = out_gpu.cstep;
+            constants[6].i = xi * TILE_SIZE_X * pass_scale;
+            constants[7].i = (std::min)(TILE_SIZE_X * pass_scale, w * pass_scale - xi * TILE_SIZE_X * pass_scale);
+            constants[8].i = channels;
+            constants[9].i = out_alpha_tile_gpu.w;
+            constants[10].i = out_alpha_tile_gpu.h;
+            constants[11].i = out_stride;
+            constants[12].i = out_uvstride;
+            constants[13].i = yi * TILE_SIZE_Y * pass_scale;
+            constants[14].i = maxv;
+            if (pass.rgb_out)
+                rgb_constants(&constants[15], false);
+            else
+                format_constants(&constants[15]);
+            constants[21].i = (tta_level == 8) ? out_tile_gpu[4].cstep : out_tile_gpu[0].cstep;
+            constants[22].i = voffset0;
+            constants[23].i = voffset1;
+            constants[24].i = out_y0;
+
+            ncnn::VkMat dispatcher;
+            // one invocation per 32-bit word
+            dispatcher.w = ((std::min)(TILE_SIZE_X * pass_scale, w * pass_scale - xi * TILE_SIZE_X * pass_scale) + 4 / out_bytes - 1) / (4 / out_bytes);
+            dispatcher.h = out_h;
+            dispatcher.c = channels;
+
+            cmd.record_pipeline(postproc, bindings, constants, dispatcher);
+        }
+    }
+    else
     {
-        bicubic_2x = ncnn::create_layer("Interp");
-        bicubic_2x->vkdev = vkdev;
+        // preproc
+        ncnn::VkMat in_tile_gpu;
+        {
+            // crop tile
+            int tile_x0 = xi * TILE_SIZE_X - prepadding;
+            int tile_x1 = (std::min)((xi + 1) * TILE_SIZE_X, w) + prepadding_right;
+            int tile_y0 = yi * TILE_SIZE_Y - prepadding;
+            int tile_y1 = (std::min)((yi + 1) * TILE_SIZE_Y, h) + prepadding_bottom;
+
+            in_tile_gpu.create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+
+            std::vector<ncnn::VkMat> bindings(3);
+            bindings[0] = in_gpu;
+            bindings[1] = in_tile_gpu;
+            bindings[2] = in_alpha_tile_gpu;
+
+            std::vector<ncnn::vk_constant_type> constants(25);
+            constants[0].i = w;
+            constants[1].i = in_gpu.h;
+            constants[2].i = in_gpu.cstep;
+            constants[3].i = in_tile_gpu.w;
+            constants[4].i = in_tile_gpu.h;
+            constants[5].i = in_tile_gpu.cstep;
+            constants[6].i = prepadding;
+            constants[7].i = prepadding;
+            constants[8].i = xi * TILE_SIZE_X;
+            constants[9].i = yi * TILE_SIZE_Y - in_y0;
+            constants[10].i = channels;
+            constants[11].i = in_alpha_tile_gpu.w;
+            constants[12].i = in_alpha_tile_gpu.h;
+            constants[13].i = in_stride;
+            constants[14].i = in_uvstride;
+            constants[15].i = in_y0;
+            constants[16].i = (std::max)(in_y0 / 2 - 1, 0);
+            constants[17].i = w / 2;
+            constants[18].i = h / 2;
+            if (pass.rgb_in)
+                rgb_constants(&constants[19], true);
+            else
+                format_constants(&constants[19]);
+
+            ncnn::VkMat dispatcher;
+            dispatcher.w = in_tile_gpu.w;
+            dispatcher.h = in_tile_gpu.h;
+            dispatcher.c = channels;
+
+            cmd.record_pipeline(preproc, bindings, constants, dispatcher);
+        }
+
+        timestamp(1);
+
+        // waifu2x
+        ncnn::VkMat out_tile_gpu;
+        {
+            ncnn::Extractor ex = net->create_extractor();
+
+            ex.set_blob_vkallocator(blob_vkallocator);
+            ex.set_workspace_vkallocator(blob_vkallocator);
+            ex.set_staging_vkallocator(staging_vkallocator);
+
+            ex.input(input_blob, in_tile_gpu);
+
+            ex.extract(output_blob, out_tile_gpu, cmd);
+        }
+
+        ncnn::VkMat out_alpha_tile_gpu;
+        if (alpha && pass_scale == 1)
+            out_alpha_tile_gpu = in_alpha_tile_gpu;
+        else if (alpha)
+            bicubic_2x->forward(in_alpha_tile_gpu, out_alpha_tile_gpu, cmd, opt);
+
+        timestamp(2);
+
+        // postproc
+        {
+            std::vector<ncnn::VkMat> bindings(3);
+            bindings[0] = out_tile_gpu;
+            bindings[1] = out_alpha_tile_gpu;
+            bindings[2] = out_gpu;
+
+            std::vector<ncnn::vk_constant_type> constants(22);
+            constants[0].i = out_tile_gpu.w;
+            constants[1].i = out_tile_gpu.h;
+            constants[2].i = out_tile_gpu.cstep;
+            constants[3].i = w * pass_scale;
+            constants[4].i = out_h;
+            constants[5].i = out_gpu.cstep;
+            constants[6].i = xi * TILE_SIZE_X * pass_scale;
+            constants[7].i = (std::min)(TILE_SIZE_X * pass_scale, w * pass_scale - xi * TILE_SIZE_X * pass_scale);
+            constants[8].i = channels;
+            constants[9].i = out_alpha_tile_gpu.w;
+            constants[10].i = out_alpha_tile_gpu.h;
+            constants[11].i = out_stride;
+            constants[12].i = out_uvstride;
+            constants[13].i = yi * TILE_SIZE_Y * pass_scale;
+            constants[14].i = maxv;
+            if (pass.rgb_out)
+                rgb_constants(&constants[15], false);
+            else
+                format_constants(&constants[15]);
+            constants[21].i = out_y0;
 
-        ncnn::ParamDict pd;
-        pd.set(0, 3);// bicubic
-        pd.set(1, 2.f);
-        pd.set(2, 2.f);
-        bicubic_2x->load_param(pd);
+            ncnn::VkMat dispatcher;
+            // one invocation per 32-bit word
+            dispatcher.w = ((std::min)(TILE_SIZE_X * pass_scale, w * pass_scale - xi * TILE_SIZE_X * pass_scale) + 4 / out_bytes - 1) / (4 / out_bytes);
+            dispatcher.h = out_h;
+            dispatcher.c = channels;
 
-        bicubic_2x->create_pipeline(net.opt);
+            cmd.record_pipeline(postproc, bindings, constants, dispatcher);
+        }
     }
 
-    return 0;
+    timestamp(3);
 }
 
-int Waifu2x::process(const float* srcR, const float* srcG, const float* srcB,
-    float* dstR, float* dstG, float* dstB,
-    const int w, const int h, const ptrdiff_t srcStride, const ptrdiff_t dstStride) const
+int Waifu2x::process_cpu(const Frame* frames, const int count, const int w, const int h, Stats* stats) const
 {
+    // the passes of scale 4 and 8 are only chained on the GPU
+    if (scale > 2)
+        return -1;
+
     constexpr int channels = 3;
 
     const int TILE_SIZE_X = tile_w;
     const int TILE_SIZE_Y = tile_h;
 
-    ncnn::VkAllocator* blob_vkallocator = vkdev->acquire_blob_allocator();
-    ncnn::VkAllocator* staging_vkallocator = vkdev->acquire_staging_allocator();
-
-    ncnn::Option opt = net.opt;
-    opt.blob_vkallocator = blob_vkallocator;
-    opt.workspace_vkallocator = blob_vkallocator;
-    opt.staging_vkallocator = staging_vkallocator;
-
-    // each tile 400x400
     const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
     const int ytiles = (h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
+    const int ntiles = xtiles * ytiles * count;
 
-    const size_t in_out_tile_elemsize = opt.use_fp16_storage ? 2u : 4u;
+    // spread the threads over the tiles of all frames first, whatever is left goes to each extractor
+    const int tile_threads = (std::min)(num_threads, ntiles);
+    const int extractor_threads = (std::max)(num_threads / tile_threads, 1);
 
-    //#pragma omp parallel for num_threads(2)
-    for (int yi = 0; yi < ytiles; ++yi)
+    // summed over the threads
+    double upload = 0.0;
+    double infer = 0.0;
+    double download = 0.0;
+    int reused = 0;
+
+    #pragma omp parallel for num_threads(tile_threads) schedule(dynamic) reduction(+:upload, infer, download, reused)
+    for (int i = 0; i < ntiles; ++i)
     {
+        const auto t0 = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point t1;
+        std::chrono::steady_clock::time_point t2;
+
+        const Frame& frame = frames[i / (xtiles * ytiles)];
+        const int yi = i % (xtiles * ytiles) / xtiles;
+        const int xi = i % xtiles;
+
+        // a tile whose input was seen before is written from the tile cache
+        uint64_t key = 0;
+        std::vector<uint8_t> input;
+        if (tile_cache_size > 0)
+        {
+            key = tile_key(frame, &input, xi, yi, w, h);
+
+            if (const TileCache::Tile hit = tile_cache->find(key, input))
+            {
+                copy_tile(frame, nullptr, hit.get(), xi, yi, w, h);
+
+                download += to_ms(std::chrono::steady_clock::now() - t0);
+                ++reused;
+                continue;
+            }
+        }
+
+        const int tile_w_nopad = (std::min)((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X;
         const int tile_h_nopad = (std::min)((yi + 1) * TILE_SIZE_Y, h) - yi * TILE_SIZE_Y;
 
+        int prepadding_right = prepadding;
         int prepadding_bottom = prepadding;
         if (scale == 1)
         {
+            prepadding_right += (tile_w_nopad + 3) / 4 * 4 - tile_w_nopad;
             prepadding_bottom += (tile_h_nopad + 3) / 4 * 4 - tile_h_nopad;
         }
         if (scale == 2)
         {
+            prepadding_right += (tile_w_nopad + 1) / 2 * 2 - tile_w_nopad;
             prepadding_bottom += (tile_h_nopad + 1) / 2 * 2 - tile_h_nopad;
         }
 
-        int in_tile_y0 = (std::max)(yi * TILE_SIZE_Y - prepadding, 0);
-        int in_tile_y1 = (std::min)((yi + 1) * TILE_SIZE_Y + prepadding_bottom, h);
-
-        ncnn::Mat in;
-        in.create(w, in_tile_y1 - in_tile_y0, channels, (size_t)4u, 1);
-        float* inR{ in.channel(0) };
-        float* inG{ in.channel(1) };
-        float* inB{ in.channel(2) };
-        for (auto y{ 0 }; y < in.h; ++y) {
-            std::memcpy(inR + y * in.w, srcR + (in_tile_y0 + y) * srcStride, in.w * sizeof(float));
-            std::memcpy(inG + y * in.w, srcG + (in_tile_y0 + y) * srcStride, in.w * sizeof(float));
-            std::memcpy(inB + y * in.w, srcB + (in_tile_y0 + y) * srcStride, in.w * sizeof(float));
-        }
+        // crop tile, same as waifu2x_preproc
+        const int tile_x0 = xi * TILE_SIZE_X - prepadding;
+        const int tile_y0 = yi * TILE_SIZE_Y - prepadding;
+        const int in_tile_w = tile_w_nopad + prepadding + prepadding_right;
+        const int in_tile_h = tile_h_nopad + prepadding + prepadding_bottom;
 
-        ncnn::VkCompute cmd(vkdev);
+        ncnn::Mat in_tile;
+        in_tile.create(in_tile_w, in_tile_h, channels, (size_t)4u, 1);
 
-        // upload
-        ncnn::VkMat in_gpu;
+        for (int q = 0; q < channels; ++q)
         {
-            cmd.record_clone(in, in_gpu, opt);
+            float* ptr = in_tile.channel(q);
 
-            if (xtiles > 1)
+            for (int y = 0; y < in_tile_h; ++y)
             {
-                cmd.submit_and_wait();
-                cmd.reset();
+                const int sy = std::clamp(tile_y0 + y, 0, h - 1);
+
+                for (int x = 0; x < in_tile_w; ++x)
+                    ptr[y * in_tile_w + x] = std::clamp(load_rgb(frame, q, std::clamp(tile_x0 + x, 0, w - 1), sy, w, h), 0.0f, 1.0f);
             }
         }
 
-        int out_tile_y0 = (std::max)(yi * TILE_SIZE_Y, 0);
-        int out_tile_y1 = (std::min)((yi + 1) * TILE_SIZE_Y, h);
-
-        ncnn::VkMat out_gpu;
-        out_gpu.create(w * scale, (out_tile_y1 - out_tile_y0) * scale, channels, (size_t)4u, 1, blob_vkallocator);
+        const int out_x0 = xi * TILE_SIZE_X * scale;
+        const int out_y0 = yi * TILE_SIZE_Y * scale;
+        const int out_tile_w = tile_w_nopad * scale;
+        const int out_tile_h = tile_h_nopad * scale;
 
-        for (int xi = 0; xi < xtiles; ++xi)
+        // alpha without the prepadding, upscaled by bicubic_2x
+        ncnn::Mat out_alpha;
+        if (alpha)
         {
-            const int tile_w_nopad = (std::min)((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X;
+            ncnn::Mat in_alpha;
+            in_alpha.create(tile_w_nopad, tile_h_nopad, 1, (size_t)4u, 1);
+
+            float* ptr = in_alpha.channel(0);
 
-            int prepadding_right = prepadding;
-            if (scale == 1)
+            for (int y = 0; y < tile_h_nopad; ++y)
             {
-                prepadding_right += (tile_w_nopad + 3) / 4 * 4 - tile_w_nopad;
+                for (int x = 0; x < tile_w_nopad; ++x)
+                    ptr[y * tile_w_nopad + x] = load(frame.src[3], (yi * TILE_SIZE_Y + y) * frame.srcStride[3] + xi * TILE_SIZE_X + x) / ymul;
             }
+
             if (scale == 2)
             {
-                prepadding_right += (tile_w_nopad + 1) / 2 * 2 - tile_w_nopad;
+                ncnn::Option opt = net->opt;
+                opt.num_threads = extractor_threads;
+
+                bicubic_2x->forward(in_alpha, out_alpha, opt);
+            }
+            else
+            {
+                out_alpha = in_alpha;
             }
+        }
 
-            if (tta_mode)
+        if (tta_level > 1)
+        {
+            // same stacking as the GPU path
+            const bool stacked = stack_tta && tta_stackable;
+            const int stack0 = (std::min)(tta_level, 4);
+            const int stack1 = tta_level - stack0;
+
+            // preproc, only the first tta_level transforms
+            ncnn::Mat in_tile_tta[8];
             {
-                // preproc
-                ncnn::VkMat in_tile_gpu[8];
-                ncnn::VkMat in_alpha_tile_gpu;
+                const int tw = in_tile_w;
+                const int th = in_tile_h;
+
+                if (stacked)
                 {
-                    // crop tile
-                    int tile_x0 = xi * TILE_SIZE_X - prepadding;
-                    int tile_x1 = (std::min)((xi + 1) * TILE_SIZE_X, w) + prepadding_right;
-                    int tile_y0 = yi * TILE_SIZE_Y - prepadding;
-                    int tile_y1 = (std::min)((yi + 1) * TILE_SIZE_Y, h) + prepadding_bottom;
-
-                    in_tile_gpu[0].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[1].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[2].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[3].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[4].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[5].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[6].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[7].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-
-                    std::vector<ncnn::VkMat> bindings(10);
-                    bindings[0] = in_gpu;
-                    bindings[1] = in_tile_gpu[0];
-                    bindings[2] = in_tile_gpu[1];
-                    bindings[3] = in_tile_gpu[2];
-                    bindings[4] = in_tile_gpu[3];
-                    bindings[5] = in_tile_gpu[4];
-                    bindings[6] = in_tile_gpu[5];
-                    bindings[7] = in_tile_gpu[6];
-                    bindings[8] = in_tile_gpu[7];
-                    bindings[9] = in_alpha_tile_gpu;
-
-                    std::vector<ncnn::vk_constant_type> constants(13);
-                    constants[0].i = in_gpu.w;
-                    constants[1].i = in_gpu.h;
-                    constants[2].i = in_gpu.cstep;
-                    constants[3].i = in_tile_gpu[0].w;
-                    constants[4].i = in_tile_gpu[0].h;
-                    constants[5].i = in_tile_gpu[0].cstep;
-                    constants[6].i = prepadding;
-                    constants[7].i = prepadding;
-                    constants[8].i = xi * TILE_SIZE_X;
-                    constants[9].i = (std::min)(yi * TILE_SIZE_Y, prepadding);
-                    constants[10].i = channels;
-                    constants[11].i = in_alpha_tile_gpu.w;
-                    constants[12].i = in_alpha_tile_gpu.h;
-
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = in_tile_gpu[0].w;
-                    dispatcher.h = in_tile_gpu[0].h;
-                    dispatcher.c = channels;
-
-                    cmd.record_pipeline(waifu2x_preproc, bindings, constants, dispatcher);
+                    in_tile_tta[0].create(tw, th * stack0, channels, (size_t)4u, 1);
+                    if (stack1)
+                        in_tile_tta[4].create(th, tw * stack1, channels, (size_t)4u, 1);
                 }
-
-                // waifu2x
-                ncnn::VkMat out_tile_gpu[8];
-                for (int ti = 0; ti < 8; ++ti)
+                else
                 {
-                    ncnn::Extractor ex = net.create_extractor();
+                    for (int ti = 0; ti < tta_level; ++ti)
+                    {
+                        if (ti < 4)
+                            in_tile_tta[ti].create(tw, th, channels, (size_t)4u, 1);
+                        else
+                            in_tile_tta[ti].create(th, tw, channels, (size_t)4u, 1);
+                    }
+                }
 
-                    ex.set_blob_vkallocator(blob_vkallocator);
-                    ex.set_workspace_vkallocator(blob_vkallocator);
-                    ex.set_staging_vkallocator(staging_vkallocator);
+                // channel q of transform ti
+                const auto tta_channel = [&](const int ti, const int q) -> float*
+                {
+                    if (!stacked)
+                        return in_tile_tta[ti].channel(q);
 
-                    ex.input("Input1", in_tile_gpu[ti]);
+                    return static_cast<float*>(in_tile_tta[ti < 4 ? 0 : 4].channel(q)) + (ti % 4) * tw * th;
+                };
 
-                    ex.extract("Eltwise4", out_tile_gpu[ti], cmd);
+                for (int q = 0; q < channels; ++q)
+                {
+                    const float* ptr = in_tile.channel(q);
+                    float* t0 = tta_channel(0, q);
+                    float* t1 = tta_channel(1, q);
+                    float* t2 = tta_channel(2, q);
+                    float* t3 = tta_channel(3, q);
+                    float* t4 = tta_channel(4, q);
+                    float* t5 = tta_channel(5, q);
+                    float* t6 = tta_channel(6, q);
+                    float* t7 = tta_channel(7, q);
+
+                    for (int y = 0; y < th; ++y)
+                    {
+                        for (int x = 0; x < tw; ++x)
+                        {
+                            const float v = ptr[y * tw + x];
+
+                            t0[y * tw + x] = v;
+                            t1[y * tw + (tw - 1 - x)] = v;
+
+                            if (tta_level >= 4)
+                            {
+                                t2[(th - 1 - y) * tw + (tw - 1 - x)] = v;
+                                t3[(th - 1 - y) * tw + x] = v;
+                            }
+
+                            if (tta_level == 8)
+                            {
+                                t4[x * th + y] = v;
+                                t5[x * th + (th - 1 - y)] = v;
+                                t6[(tw - 1 - x) * th + (th - 1 - y)] = v;
+                                t7[(tw - 1 - x) * th + y] = v;
+                            }
+                        }
+                    }
                 }
+            }
 
-                ncnn::VkMat out_alpha_tile_gpu;
+            t1 = std::chrono::steady_clock::now();
+            upload += to_ms(t1 - t0);
 
-                // postproc
-                {
-                    std::vector<ncnn::VkMat> bindings(10);
-                    bindings[0] = out_tile_gpu[0];
-                    bindings[1] = out_tile_gpu[1];
-                    bindings[2] = out_tile_gpu[2];
-                    bindings[3] = out_tile_gpu[3];
-                    bindings[4] = out_tile_gpu[4];
-                    bindings[5] = out_tile_gpu[5];
-                    bindings[6] = out_tile_gpu[6];
-                    bindings[7] = out_tile_gpu[7];
-                    bindings[8] = out_alpha_tile_gpu;
-                    bindings[9] = out_gpu;
-
-                    std::vector<ncnn::vk_constant_type> constants(11);
-                    constants[0].i = out_tile_gpu[0].w;
-                    constants[1].i = out_tile_gpu[0].h;
-                    constants[2].i = out_tile_gpu[0].cstep;
-                    constants[3].i = out_gpu.w;
-                    constants[4].i = out_gpu.h;
-                    constants[5].i = out_gpu.cstep;
-                    constants[6].i = xi * TILE_SIZE_X * scale;
-                    constants[7].i = (std::min)(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    constants[8].i = channels;
-                    constants[9].i = out_alpha_tile_gpu.w;
-                    constants[10].i = out_alpha_tile_gpu.h;
-
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = (std::min)(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    dispatcher.h = out_gpu.h;
-                    dispatcher.c = channels;
-
-                    cmd.record_pipeline(waifu2x_postproc, bindings, constants, dispatcher);
-                }
+            // waifu2x, once per stack or once per transform
+            ncnn::Mat out_tile_tta[8];
+            for (int ti = 0; ti < tta_level; ti += stacked ? 4 : 1)
+            {
+                ncnn::Extractor ex = net->create_extractor();
+
+                ex.set_num_threads(extractor_threads);
+
+                ex.input(input_blob, in_tile_tta[ti]);
+
+                ex.extract(output_blob, out_tile_tta[ti]);
             }
-            else
+
+            t2 = std::chrono::steady_clock::now();
+            infer += to_ms(t2 - t1);
+
+            // postproc
             {
-                // preproc
-                ncnn::VkMat in_tile_gpu;
-                ncnn::VkMat in_alpha_tile_gpu;
+                // the transforms of a stack are in_tile_h * scale (in_tile_w * scale) rows apart
+                const int ow = out_tile_tta[0].w;
+                const int oh = stacked ? out_tile_tta[0].h - (stack0 - 1) * in_tile_h * scale : out_tile_tta[0].h;
+
+                const auto tta_channel = [&](const int ti, const int q) -> const float*
                 {
-                    // crop tile
-                    int tile_x0 = xi * TILE_SIZE_X - prepadding;
-                    int tile_x1 = (std::min)((xi + 1) * TILE_SIZE_X, w) + prepadding_right;
-                    int tile_y0 = yi * TILE_SIZE_Y - prepadding;
-                    int tile_y1 = (std::min)((yi + 1) * TILE_SIZE_Y, h) + prepadding_bottom;
-
-                    in_tile_gpu.create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-
-                    std::vector<ncnn::VkMat> bindings(3);
-                    bindings[0] = in_gpu;
-                    bindings[1] = in_tile_gpu;
-                    bindings[2] = in_alpha_tile_gpu;
-
-                    std::vector<ncnn::vk_constant_type> constants(13);
-                    constants[0].i = in_gpu.w;
-                    constants[1].i = in_gpu.h;
-                    constants[2].i = in_gpu.cstep;
-                    constants[3].i = in_tile_gpu.w;
-                    constants[4].i = in_tile_gpu.h;
-                    constants[5].i = in_tile_gpu.cstep;
-                    constants[6].i = prepadding;
-                    constants[7].i = prepadding;
-                    constants[8].i = xi * TILE_SIZE_X;
-                    constants[9].i = (std::min)(yi * TILE_SIZE_Y, prepadding);
-                    constants[10].i = channels;
-                    constants[11].i = in_alpha_tile_gpu.w;
-                    constants[12].i = in_alpha_tile_gpu.h;
-
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = in_tile_gpu.w;
-                    dispatcher.h = in_tile_gpu.h;
-                    dispatcher.c = channels;
-
-                    cmd.record_pipeline(waifu2x_preproc, bindings, constants, dispatcher);
-                }
+                    if (!stacked)
+                        return out_tile_tta[ti].channel(q);
+
+                    return static_cast<const float*>(out_tile_tta[ti < 4 ? 0 : 4].channel(q)) + (ti % 4) * (ti < 4 ? in_tile_h * scale * ow : in_tile_w * scale * oh);
+                };
 
-                // waifu2x
-                ncnn::VkMat out_tile_gpu;
+                ncnn::Mat out_tile;
+                out_tile.create(out_tile_w, out_tile_h, channels, (size_t)4u, 1);
+
+                for (int q = 0; q < channels; ++q)
                 {
-                    ncnn::Extractor ex = net.create_extractor();
+                    const float* o0 = tta_channel(0, q);
+                    const float* o1 = tta_channel(1, q);
+                    const float* o2 = tta_channel(2, q);
+                    const float* o3 = tta_channel(3, q);
+                    const float* o4 = tta_channel(4, q);
+                    const float* o5 = tta_channel(5, q);
+                    const float* o6 = tta_channel(6, q);
+                    const float* o7 = tta_channel(7, q);
+
+                    float* ptr = out_tile.channel(q);
+
+                    for (int y = 0; y < out_tile_h; ++y)
+                    {
+                        for (int x = 0; x < out_tile_w; ++x)
+                        {
+                            float v = o0[y * ow + x];
+                            v += o1[y * ow + (ow - 1 - x)];
+
+                            if (tta_level >= 4)
+                            {
+                                v += o2[(oh - 1 - y) * ow + (ow - 1 - x)];
+                                v += o3[(oh - 1 - y) * ow + x];
+                            }
+
+                            if (tta_level == 8)
+                            {
+                                v += o4[x * oh + y];
+                                v += o5[x * oh + (oh - 1 - y)];
+                                v += o6[(ow - 1 - x) * oh + (oh - 1 - y)];
+                                v += o7[(ow - 1 - x) * oh + y];
+                            }
+
+                            ptr[y * out_tile_w + x] = v * (1.f / tta_level);
+                        }
+                    }
+                }
+
+                store_tile(frame, out_tile, out_alpha, out_x0, out_y0, out_tile_w, out_tile_h);
+            }
+        }
+        else
+        {
+            t1 = std::chrono::steady_clock::now();
+            upload += to_ms(t1 - t0);
+
+            // waifu2x
+            ncnn::Mat out_tile;
+            {
+                ncnn::Extractor ex = net->create_extractor();
+
+                ex.set_num_threads(extractor_threads);
+
+                ex.input(input_blob, in_tile);
+
+                ex.extract(output_blob, out_tile);
+            }
+
+            t2 = std::chrono::steady_clock::now();
+            infer += to_ms(t2 - t1);
+
+            // postproc
+            store_tile(frame, out_tile, out_alpha, out_x0, out_y0, out_tile_w, out_tile_h);
+        }
+
+        if (tile_cache_size > 0)
+        {
+            auto tile = std::make_shared<std::vector<uint8_t>>();
+            copy_tile(frame, tile.get(), nullptr, xi, yi, w, h);
+            tile_cache->insert(key, std::move(input), std::move(tile), tile_cache_size);
+        }
+
+        download += to_ms(std::chrono::steady_clock::now() - t2);
+    }
+
+    if (stats)
+    {
+        stats->upload = upload;
+        stats->infer = infer;
+        stats->download = download;
+        stats->tiles = ntiles;
+        stats->reused = reused;
+    }
+
+    return 0;
+}
+
+float Waifu2x::load(const void* plane, const ptrdiff_t i) const
+{
+    if (bytes == 1)
+        return static_cast<const uint8_t*>(plane)[i];
+    if (bytes == 2)
+        return static_cast<const uint16_t*>(plane)[i];
+    return static_cast<const float*>(plane)[i];
+}
+
+// same as rgb() of waifu2x_preproc
+float Waifu2x::load_rgb(const Frame& frame, const int q, const int x, const int y, const int w, const int h) const
+{
+    if (yuv == 0)
+        return (load(frame.src[q], y * frame.srcStride[q] + x) - yadd) / ymul;
+
+    float uv[2];
 
-                    ex.set_blob_vkallocator(blob_vkallocator);
-                    ex.set_workspace_vkallocator(blob_vkallocator);
-                    ex.set_staging_vkallocator(staging_vkallocator);
+    for (int c = 0; c < 2; ++c)
+    {
+        const void* plane = frame.src[c + 1];
+        const ptrdiff_t stride = frame.srcStride[c + 1];
+
+        if (yuv == 1)
+        {
+            uv[c] = load(plane, y * stride + x);
+            continue;
+        }
+
+        // 4:2:0 with MPEG-2 chroma siting, bilinear
+        const float fx = x * 0.5f;
+        const float fy = y * 0.5f - 0.25f;
+
+        const int ix0 = static_cast<int>(std::floor(fx));
+        const int iy0 = static_cast<int>(std::floor(fy));
+        const float ax = fx - ix0;
+        const float ay = fy - iy0;
+
+        const int ix1 = (std::min)(ix0 + 1, w / 2 - 1);
+        const int iy1 = std::clamp(iy0 + 1, 0, h / 2 - 1);
+        const int iy0c = std::clamp(iy0, 0, h / 2 - 1);
+
+        const float v00 = load(plane, iy0c * stride + ix0);
+        const float v01 = load(plane, iy0c * stride + ix1);
+        const float v10 = load(plane, iy1 * stride + ix0);
+        const float v11 = load(plane, iy1 * stride + ix1);
+
+        const float top = v00 + (v01 - v00) * ax;
+        const float bottom = v10 + (v11 - v10) * ax;
+        uv[c] = top + (bottom - top) * ay;
+    }
+
+    const float Y = (load(frame.src[0], y * frame.srcStride[0] + x) - yadd) / ymul;
+    const float U = (uv[0] - cadd) / cmul;
+    const float V = (uv[1] - cadd) / cmul;
+
+    if (q == 0)
+        return Y + 2.f * (1.f - kr) * V;
+    if (q == 2)
+        return Y + 2.f * (1.f - kb) * U;
+
+    const float kg = 1.f - kr - kb;
+    return Y - (2.f * kb * (1.f - kb) * U + 2.f * kr * (1.f - kr) * V) / kg;
+}
+
+// same as waifu2x_postproc, rgb is the normalized output of one tile and a its alpha when there is one
+void Waifu2x::store_tile(const Frame& frame, const ncnn::Mat& rgb, const ncnn::Mat& a, const int out_x0, const int out_y0, const int out_w, const int out_h) const
+{
+    static constexpr float bayer[16] = { 0.f, 8.f, 2.f, 10.f, 12.f, 4.f, 14.f, 6.f, 3.f, 11.f, 1.f, 9.f, 15.f, 7.f, 13.f, 5.f };
 
-                    ex.input("Input1", in_tile_gpu);
+    const float* r = rgb.channel(0);
+    const float* g = rgb.channel(1);
+    const float* b = rgb.channel(2);
+    const float* planes[4] = { r, g, b, alpha ? static_cast<const float*>(a.channel(0)) : nullptr };
+    const int rw = rgb.w;
 
-                    ex.extract("Eltwise4", out_tile_gpu, cmd);
+    for (int q = 0; q < (alpha ? 4 : 3); ++q)
+    {
+        const int sub = (yuv == 2 && q > 0) ? 2 : 1;
+        const int pw = (out_w + sub - 1) / sub;
+        const int ph = out_h / sub;
+        const ptrdiff_t stride = frame.dstStride[q];
+        const bool luma = q == 0 || yuv == 0;
+        const float mul = luma ? ymul : cmul;
+        const float add = luma ? yadd : cadd;
+
+        for (int y = 0; y < ph; ++y)
+        {
+            for (int x = 0; x < pw; ++x)
+            {
+                float v;
+
+                if (q == 3)
+                {
+                    v = planes[q][y * a.w + x];
+                }
+                else if (yuv == 0)
+                {
+                    v = planes[q][y * rw + x];
+                }
+                else
+                {
+                    float pr;
+                    float pg;
+                    float pb;
+
+                    if (sub == 2)
+                    {
+                        // 4:2:0, average of the 2x2 block
+                        const int i00 = y * 2 * rw + x * 2;
+                        const int i01 = y * 2 * rw + (std::min)(x * 2 + 1, out_w - 1);
+                        const int i10 = (std::min)(y * 2 + 1, out_h - 1) * rw + x * 2;
+                        const int i11 = (std::min)(y * 2 + 1, out_h - 1) * rw + (std::min)(x * 2 + 1, out_w - 1);
+
+                        pr = (r[i00] + r[i01] + r[i10] + r[i11]) * 0.25f;
+                        pg = (g[i00] + g[i01] + g[i10] + g[i11]) * 0.25f;
+                        pb = (b[i00] + b[i01] + b[i10] + b[i11]) * 0.25f;
+                    }
+                    else
+                    {
+                        pr = r[y * rw + x];
+                        pg = g[y * rw + x];
+                        pb = b[y * rw + x];
+                    }
+
+                    const float Y = kr * pr + (1.f - kr - kb) * pg + kb * pb;
+
+                    if (q == 0)
+                        v = Y;
+                    else if (q == 1)
+                        v = (pb - Y) / (2.f * (1.f - kb));
+                    else
+                        v = (pr - Y) / (2.f * (1.f - kr));
                 }
 
-                ncnn::VkMat out_alpha_tile_gpu;
+                const ptrdiff_t i = (out_y0 / sub + y) * stride + out_x0 / sub + x;
 
-                // postproc
+                if (bytes == 4)
                 {
-                    std::vector<ncnn::VkMat> bindings(3);
-                    bindings[0] = out_tile_gpu;
-                    bindings[1] = out_alpha_tile_gpu;
-                    bindings[2] = out_gpu;
-
-                    std::vector<ncnn::vk_constant_type> constants(11);
-                    constants[0].i = out_tile_gpu.w;
-                    constants[1].i = out_tile_gpu.h;
-                    constants[2].i = out_tile_gpu.cstep;
-                    constants[3].i = out_gpu.w;
-                    constants[4].i = out_gpu.h;
-                    constants[5].i = out_gpu.cstep;
-                    constants[6].i = xi * TILE_SIZE_X * scale;
-                    constants[7].i = (std::min)(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    constants[8].i = channels;
-                    constants[9].i = out_alpha_tile_gpu.w;
-                    constants[10].i = out_alpha_tile_gpu.h;
-
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = (std::min)(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    dispatcher.h = out_gpu.h;
-                    dispatcher.c = channels;
-
-                    cmd.record_pipeline(waifu2x_postproc, bindings, constants, dispatcher);
+                    // the rounding of the original 8-bit output, kept for RGB
+                    const float clip_eps = 0.5f / 255.f;
+
+                    static_cast<float*>(frame.dst[q])[i] = (yuv == 0 && q != 3) ? v + clip_eps : v;
+                    continue;
                 }
-            }
 
-            if (xtiles > 1)
-            {
-                cmd.submit_and_wait();
-                cmd.reset();
+                // ordered dither
+                const int dx = (out_x0 / sub + x) & 3;
+                const int dy = (out_y0 / sub + y) & 3;
+
+                v = std::floor(v * mul + add + (bayer[dy * 4 + dx] + 0.5f) / 16.f);
+                v = std::clamp(v, 0.f, static_cast<float>(maxv));
+
+                if (bytes == 1)
+                    static_cast<uint8_t*>(frame.dst[q])[i] = static_cast<uint8_t>(v);
+                else
+                    static_cast<uint16_t*>(frame.dst[q])[i] = static_cast<uint16_t>(v);
             }
         }
+    }
+}
+
+// hash of everything the output of tile xi, yi depends on: the input tile with its prepadding and the geometry
+uint64_t Waifu2x::tile_key(const Frame& frame, std::vector<uint8_t>* input, const int xi, const int yi, const int w, const int h) const
+{
+    const int tile_w_nopad = (std::min)((xi + 1) * tile_w, w) - xi * tile_w;
+    const int tile_h_nopad = (std::min)((yi + 1) * tile_h, h) - yi * tile_h;
+
+    int prepadding_right = prepadding;
+    int prepadding_bottom = prepadding;
+    if (scale == 1)
+    {
+        prepadding_right += (tile_w_nopad + 3) / 4 * 4 - tile_w_nopad;
+        prepadding_bottom += (tile_h_nopad + 3) / 4 * 4 - tile_h_nopad;
+    }
+    if (scale == 2)
+    {
+        prepadding_right += (tile_w_nopad + 1) / 2 * 2 - tile_w_nopad;
+        prepadding_bottom += (tile_h_nopad + 1) / 2 * 2 - tile_h_nopad;
+    }
+
+    // the pixels outside of the frame are clamped, so the region is clamped too
+    const int x0 = (std::max)(xi * tile_w - prepadding, 0);
+    const int x1 = (std::min)(xi * tile_w + tile_w_nopad + prepadding_right, w);
+    const int y0 = (std::max)(yi * tile_h - prepadding, 0);
+    const int y1 = (std::min)(yi * tile_h + tile_h_nopad + prepadding_bottom, h);
+
+    const int geometry[] = { w, h, xi, yi, tile_w, tile_h, noise, scale, prepadding };
+    uint64_t hash = hash_bytes(0xcbf29ce484222325ull, geometry, sizeof(geometry));
+
+    input->insert(input->end(), reinterpret_cast<const uint8_t*>(geometry), reinterpret_cast<const uint8_t*>(geometry) + sizeof(geometry));
 
-        // download
+    const size_t size = half ? 4 : bytes;
+
+    for (int q = 0; q < (alpha ? 4 : 3); ++q)
+    {
+        int px0 = x0;
+        int px1 = x1;
+        int py0 = y0;
+        int py1 = y1;
+
+        // 4:2:0 chroma samples reached by the bilinear upsampling
+        if (yuv == 2 && q > 0)
         {
-            ncnn::Mat out;
+            px0 = (std::max)(x0 / 2 - 1, 0);
+            px1 = (std::min)((x1 - 1) / 2 + 2, w / 2);
+            py0 = (std::max)(y0 / 2 - 1, 0);
+            py1 = (std::min)((y1 - 1) / 2 + 2, h / 2);
+        }
 
-            cmd.record_clone(out_gpu, out, opt);
+        const uint8_t* plane = static_cast<const uint8_t*>(frame.src[q]);
 
-            cmd.submit_and_wait();
+        for (int y = py0; y < py1; ++y)
+        {
+            const uint8_t* row = plane + (y * frame.srcStride[q] + px0) * size;
 
-            const float* outR{ out.channel(0) };
-            const float* outG{ out.channel(1) };
-            const float* outB{ out.channel(2) };
-            for (auto y{ 0 }; y < out.h; ++y) {
-                std::memcpy(dstR + (yi * scale * TILE_SIZE_Y + y) * dstStride, outR + y * out.w, out.w * sizeof(float));
-                std::memcpy(dstG + (yi * scale * TILE_SIZE_Y + y) * dstStride, outG + y * out.w, out.w * sizeof(float));
-                std::memcpy(dstB + (yi * scale * TILE_SIZE_Y + y) * dstStride, outB + y * out.w, out.w * sizeof(float));
-            }
+            hash = hash_words(hash, row, (px1 - px0) * size);
+            input->insert(input->end(), row, row + (px1 - px0) * size);
         }
     }
 
-    vkdev->reclaim_blob_allocator(blob_vkallocator);
-    vkdev->reclaim_staging_allocator(staging_vkallocator);
+    return hash;
+}
 
-    return 0;
+// appends the output tile xi, yi of the destination planes to save, or writes restore back into them
+void Waifu2x::copy_tile(const Frame& frame, std::vector<uint8_t>* save, const std::vector<uint8_t>* restore, const int xi, const int yi, const int w, const int h) const
+{
+    const size_t size = half ? 4 : bytes;
+
+    const int out_x0 = xi * tile_w * scale;
+    const int out_y0 = yi * tile_h * scale;
+    const int out_w = ((std::min)((xi + 1) * tile_w, w) - xi * tile_w) * scale;
+    const int out_h = ((std::min)((yi + 1) * tile_h, h) - yi * tile_h) * scale;
+
+    size_t pos = 0;
+
+    for (int q = 0; q < (alpha ? 4 : 3); ++q)
+    {
+        const int sub = (yuv == 2 && q > 0) ? 2 : 1;
+        const size_t n = (out_w + sub - 1) / sub * size;
+
+        for (int y = 0; y < out_h / sub; ++y)
+        {
+            uint8_t* row = static_cast<uint8_t*>(frame.dst[q]) + ((out_y0 / sub + y) * frame.dstStride[q] + out_x0 / sub) * size;
+
+            if (restore)
+                std::memcpy(row, restore->data() + pos, n);
+            else
+                save->insert(save->end(), row, row + n);
+
+            pos += n;
+        }
+    }
 }
@@ -2,7 +2,11 @@
 
 // waifu2x implemented with ncnn library
 
+#include <cstdint>
+#include <filesystem>
+#include <memory>
 #include <string>
+#include <vector>
 
 // ncnn
 #include "ncnn/gpu.h"
@@ -12,7 +16,32 @@
 class Waifu2x
 {
 public:
-    Waifu2x(int gpuid, bool tta_mode = false, int num_threads = 1);
+    // planes of one frame, R/G/B(/A) or Y/U/V, strides are in components
+    struct Frame
+    {
+        const void* src[4];
+        void* dst[4];
+        ptrdiff_t srcStride[4];
+        ptrdiff_t dstStride[4];
+    };
+
+    // wall time of the stages of one process() call in milliseconds
+    struct Stats
+    {
+        double upload; // host copies into the staging memory (gathering the tiles on the CPU)
+        double record; // recording preproc, inference and postproc
+        double gpu; // waiting for the submissions
+        double download; // host copies out of the staging memory (storing the tiles on the CPU)
+        double preproc; // GPU timestamps, only with a benchmark build of ncnn
+        double infer; // GPU timestamps, or the network on the CPU
+        double postproc; // GPU timestamps, only with a benchmark build of ncnn
+        int tiles; // tiles of all the frames
+        int reused; // tiles taken from the tile cache
+        size_t memory; // peak device memory of the blobs of the context that ran the call, in bytes
+    };
+
+    // tta_level is the number of transforms averaged: 1, 2 (flip), 4 (flips) or 8 (flips and transposes)
+    Waifu2x(int gpuid, int tta_level = 1, int num_threads = 1);
     ~Waifu2x();
 
 #if _WIN32
@@ -25,19 +54,135 @@ public:
         float* dstR, float* dstG, float* dstB,
         const int w, const int h, const ptrdiff_t srcStride, const ptrdiff_t dstStride) const;
 
+    // process several frames of the same size at once, stats is filled when given
+    // scale 4 and 8 run two and three 2x passes, the frames between the passes stay on the GPU
+    int process(const Frame* frames, const int count, const int w, const int h, Stats* stats = nullptr) const;
+
+    int process_cpu(const Frame* frames, const int count, const int w, const int h, Stats* stats = nullptr) const;
+
+    // rounds tile_w and tile_h up to what the shaders need, call after load() and setting scale
+    void align_tiles();
+
+    // picks tile_w and/or tile_h by running a blank w x h frame with the least padded tile size of every tile count that fits in budget bytes
+    // it changes the tiles and clears the contexts, so it must not run concurrently with process()
+    void autotune(const int w, const int h, const int tiles_in_flight, const size_t budget, const bool tune_w, const bool tune_h);
+
+    // runs a blank w x h frame through contexts process() calls at the same time (one on the CPU), so that the first frames
+    // don't pay for creating the contexts and the allocations, call after align_tiles()
+    // it turns off the tile cache while it runs, so it must not run concurrently with process()
+    void warmup(const int w, const int h, const int contexts);
+
+    // rough upper bound of the device memory one tile in flight needs, call after load() and setting scale and prepadding
+    size_t tile_memory(const int tw, const int th) const;
+
+    // sum of the peak device memory of the blobs of every context in bytes, it stops growing once each context has run a frame
+    size_t peak_memory() const;
+
 public:
-    // waifu2x parameters
+    // waifu2x parameters, scale 4 and 8 must be set before load()
     int noise;
     int scale;
     int tile_w;
     int tile_h;
     int prepadding;
 
+    // clip format, must be set before load()
+    int bits; // bits per component, 32 is float
+    int yuv; // 0: RGB, 1: YUV 4:4:4, 2: YUV 4:2:0
+    int matrix; // 1: BT.709, 5/6: BT.601, 9: BT.2020 NCL
+    bool full_range; // YUV only, RGB is always full range
+    bool fp16_io; // transfer float planes to and from the GPU as half precision
+    bool alpha; // RGB only, a fourth plane upscaled by bicubic_2x next to the network, same stride as the others
+
+    // the model is quantized to int8 (ncnn2int8), only with the CPU backend, must be set before load()
+    bool int8;
+
+    // read the weights from a memory mapping of the model file instead of a private copy, must be set before load()
+    // a binary param (<param>.bin, written by ncnn2mem) is used instead of the text one when it exists
+    bool map_model;
+
+    // directory of the compiled shaders kept between runs, empty to compile them every time
+    std::filesystem::path spirv_cache;
+
+    // bytes of upscaled tiles (and their inputs) kept to be reused when the same input tile (with its prepadding) comes again, 0 disables
+    size_t tile_cache_size;
+
+    // run the tta transforms of the same shape as one stacked blob through the network where the model allows it
+    bool stack_tta;
+
+    // copy whole frames to and from device memory once instead of the tile rows with their prepadding, the tile cache is off then
+    bool whole_frame;
+
+private:
+    struct Context;
+
+    // where the tiles of a pass come from and go to
+    struct Pass
+    {
+        bool rgb_in; // the float RGB frame of the previous pass instead of the planes
+        bool rgb_out; // the float RGB frame of the next pass instead of the planes
+        bool whole_in; // in_gpu is the whole frame instead of the rows of one tile row
+        bool whole_out; // out_gpu is the whole frame instead of the rows of one tile row
+    };
+
+    void init_format();
+    // a black frame of w x h in the clip format, src and dst hold its planes
+    void blank_frame(const int w, const int h, std::vector<uint8_t>* src, std::vector<uint8_t>* dst, Frame& frame) const;
+    void format_constants(ncnn::vk_constant_type* constants) const;
+    void rgb_constants(ncnn::vk_constant_type* constants, const bool preproc) const;
+    void compile_shader(const char* name, const char* comp_data, int comp_data_size, const ncnn::Option& opt, std::vector<uint32_t>& spirv) const;
+    float load(const void* plane, const ptrdiff_t i) const;
+    float load_rgb(const Frame& frame, const int q, const int x, const int y, const int w, const int h) const;
+    void store_tile(const Frame& frame, const ncnn::Mat& rgb, const ncnn::Mat& a, const int out_x0, const int out_y0, const int out_w, const int out_h) const;
+    // the hash of the input of tile xi, yi with its prepadding, the input itself is appended to input
+    uint64_t tile_key(const Frame& frame, std::vector<uint8_t>* input, const int xi, const int yi, const int w, const int h) const;
+    void copy_tile(const Frame& frame, std::vector<uint8_t>* save, const std::vector<uint8_t>* restore, const int xi, const int yi, const int w, const int h) const;
+
+    // the scale of one pass through the network
+    int net_scale() const { return (scale > 2) ? 2 : scale; }
+
+    // one pass over frames of w x h, src_gpu and dst_gpu are float RGB frames on the GPU read and written instead of the planes
+    void process_pass(const Frame* frames, const int count, const int w, const int h,
+        const std::vector<ncnn::VkMat>* src_gpu, const std::vector<ncnn::VkMat>* dst_gpu, Context& ctx, Stats* stats) const;
+    void process_row(const Frame* frames, const std::vector<ncnn::VkMat>& in_gpu, const std::vector<ncnn::VkMat>& out_gpu, const std::vector<bool>& skip,
+        const int yi, const int w, const int h, const int prepadding_bottom, const Pass& pass, Context& ctx, Stats* stats) const;
+    void record_tile(ncnn::VkCompute& cmd, const Frame& frame, const ncnn::VkMat& in_gpu, const ncnn::VkMat& out_gpu, const int xi, const int yi,
+        const int w, const int h, const int prepadding_bottom, const Pass& pass, const ncnn::Option& opt, const int query) const;
+
+    // a context of the pool, created when all of them are in use
+    Context* acquire_context() const;
+    void release_context(Context* ctx) const;
+
 private:
+    struct Pipelines;
+    struct TileCache;
+    struct ContextPool;
+
     ncnn::VulkanDevice* vkdev;
-    ncnn::Net net;
+    std::shared_ptr<ncnn::Net> net;
+    std::shared_ptr<Pipelines> pipelines;
+    std::shared_ptr<Pipelines> rgb_pipelines; // for the float RGB frames between the passes of scale 4 and 8
+    std::unique_ptr<TileCache> tile_cache;
+    std::unique_ptr<ContextPool> context_pool;
     ncnn::Pipeline* waifu2x_preproc;
     ncnn::Pipeline* waifu2x_postproc;
+    ncnn::Pipeline* rgb_preproc;
+    ncnn::Pipeline* rgb_postproc;
     ncnn::Layer* bicubic_2x;
-    bool tta_mode;
+    int tta_level;
+    bool tta_stackable;
+    int input_blob;
+    int output_blob;
+    int num_threads;
+
+    // derived from the clip format
+    bool half;
+    int bytes;
+    int maxv;
+    float kr;
+    float kb;
+    float ymul;
+    float yadd;
+    float cmul;
+    float cadd;
 };
@@ -1,3 +1,3 @@
 #pragma once
 
-static const char waifu2x_postproc_comp_data[] = { 0x23,0x76,0x65,0x72,0x73,0x69,0x6f,0x6e,0x20,0x34,0x35,0x30,0x0d,0x0a,0x0d,0x0a,0x23,0x69,0x66,0x20,0x4e,0x43,0x4e,0x4e,0x5f,0x66,0x70,0x31,0x36,0x5f,0x73,0x74,0x6f,0x72,0x61,0x67,0x65,0x0d,0x0a,0x23,0x65,0x78,0x74,0x65,0x6e,0x73,0x69,0x6f,0x6e,0x20,0x47,0x4c,0x5f,0x45,0x58,0x54,0x5f,0x73,0x68,0x61,0x64,0x65,0x72,0x5f,0x31,0x36,0x62,0x69,0x74,0x5f,0x73,0x74,0x6f,0x72,0x61,0x67,0x65,0x3a,0x20,0x72,0x65,0x71,0x75,0x69,0x72,0x65,0x0d,0x0a,0x23,0x64,0x65,0x66,0x69,0x6e,0x65,0x20,0x73,0x66,0x70,0x20,0x66,0x6c,0x6f,0x61,0x74,0x31,0x36,0x5f,0x74,0x0d,0x0a,0x23,0x65,0x6c,0x73,0x65,0x0d,0x0a,0x23,0x64,0x65,0x66,0x69,0x6e,0x65,0x20,0x73,0x66,0x70,0x20,0x66,0x6c,0x6f,0x61,0x74,0x0d,0x0a,0x23,0x65,0x6e,0x64,0x69,0x66,0x0d,0x0a,0x0d,0x0a,0x23,0x69,0x66,0x20,0x4e,0x43,0x4e,0x4e,0x5f,0x69,0x6e,0x74,0x38,0x5f,0x73,0x74,0x6f,0x72,0x61,0x67,0x65,0x0d,0x0a,0x23,0x65,0x78,0x74,0x65,0x6e,0x73,0x69,0x6f,0x6e,0x20,0x47,0x4c,0x5f,0x45,0x58,0x54,0x5f,0x73,0x68,0x61,0x64,0x65,0x72,0x5f,0x38,0x62,0x69,0x74,0x5f,0x73,0x74,0x6f,0x72,0x61,0x67,0x65,0x3a,0x20,0x72,0x65,0x71,0x75,0x69,0x72,0x65,0x0d,0x0a,0x23,0x65,0x6e,0x64,0x69,0x66,0x0d,0x0a,0x0d,0x0a,0x6c,0x61,0x79,0x6f,0x75,0x74,0x20,0x28,0x63,0x6f,0x6e,0x73,0x74,0x61,0x6e,0x74,0x5f,0x69,0x64,0x20,0x3d,0x20,0x30,0x29,0x20,0x63,0x6f,0x6e,0x73,0x74,0x20,0x69,0x6e,0x74,0x20,0x62,0x67,0x72,0x20,0x3d,0x20,0x30,0x3b,0x0d,0x0a,0x0d,0x0a,0x6c,0x61,0x79,0x6f,0x75,0x74,0x20,0x28,0x62,0x69,0x6e,0x64,0x69,0x6e,0x67,0x20,0x3d,0x20,0x30,0x29,0x20,0x72,0x65,0x61,0x64,0x6f,0x6e,0x6c,0x79,0x20,0x62,0x75,0x66,0x66,0x65,0x72,0x20,0x62,0x6f,0x74,0x74,0x6f,0x6d,0x5f,0x62,0x6c,0x6f,0x62,0x20,0x7b,0x20,0x73,0x66,0x70,0x20,0x62,0x6f,0x74,0x74,0x6f,0x6d,0x5f,0x62,0x6c,0x6f,0x62,0x5f,0x64,0x61,0x74,0x61,0x5b,0x5d,0x3b,0x20,0x7d,0x3b,0x0d,0x0a,0x6c,0x61,0x79,0x6f,0x75,0x74,0x20,0x28,0x62,0x69,0x6e,0x64,0x69,0x6e,0x67,0x20,0x3d,0x20,0x31,0x29,0x20,0x72,0x65,0x61,0x64,0x6f,0x6e,0x6c,0x79,0x20,0x62,0x75,0x66,0x66,0x65,0x72,0x20,0x61,0x6c,0x70,0x68,0x61,0x5f,0x62,0x6c,0x6f,0x62,0x20,0x7b,0x20,0x73,0x66,0x70,0x20,0x61,0x6c,0x70,0x68,0x61,0x5f,0x62,0x6c,0x6f,0x62,0x5f,0x64,0x61,0x74,0x61,0x5b,0x5d,0x3b,0x20,0x7d,0x3b,0x0d,0x0a,0x23,0x69,0x66,0x20,0x4e,0x43,0x4e,0x4e,0x5f,0x69,0x6e,0x74,0x38,0x5f,0x73,0x74,0x6f,0x72,0x61,0x67,0x65,0x0d,0x0a,0x6c,0x61,0x79,0x6f,0x75,0x74,0x20,0x28,0x62,0x69,0x6e,0x64,0x69,0x6e,0x67,0x20,0x3d,0x20,0x32,0x29,0x20,0x77,0x72,0x69,0x74,0x65,0x6f,0x6e,0x6c,0x79,0x20,0x62,0x75,0x66,0x66,0x65,0x72,0x20,0x74,0x6f,0x70,0x5f,0x62,0x6c,0x6f,0x62,0x20,0x7b,0x20,0x75,0x69,0x6e,0x74,0x38,0x5f,0x74,0x20,0x74,0x6f,0x70,0x5f,0x62,0x6c,0x6f,0x62,0x5f,0x64,0x61,0x74,0x61,0x5b,0x5d,0x3b,0x20,0x7d,0x3b,0x0d,0x0a,0x23,0x65,0x6c,0x73,0x65,0x0d,0x0a,0x6c,0x61,0x79,0x6f,0x75,0x74,0x20,0x28,0x62,0x69,0x6e,0x64,0x69,0x6e,0x67,0x20,0x3d,0x20,0x32,0x29,0x20,0x77,0x72,0x69,0x74,0x65,0x6f,0x6e,0x6c,0x79,0x20,0x62,0x75,0x66,0x66,0x65,0x72,0x20,0x74,0x6f,0x70,0x5f,0x62,0x6c,0x6f,0x62,0x20,0x7b,0x20,0x66,0x6c,0x6f,0x61,0x74,0x20,0x74,0x6f,0x70,0x5f,0x62,0x6c,0x6f,0x62,0x5f,0x64,0x61,0x74,0x61,0x5b,0x5d,0x3b,0x20,0x7d,0x3b,0x0d,0x0a,0x23,0x65,0x6e,0x64,0x69,0x66,0x0d,0x0a,0x0d,0x0a,0x6c,0x61,0x79,0x6f,0x75,0x74,0x20,0x28,0x70,0x75,0x73,0x68,0x5f,0x63,0x6f,0x6e,0x73,0x74,0x61,0x6e,0x74,0x29,0x20,0x75,0x6e,0x69,0x66,0x6f,0x72,0x6d,0x20,0x70,0x61,0x72,0x61,0x6d,0x65,0x74,0x65,0x72,0x0d,0x0a,0x7b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x77,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x68,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x63,0x73,0x74,0x65,0x70,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x6f,0x75,0x74,0x77,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x6f,0x75,0x74,0x68,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x6f,0x75,0x74,0x63,0x73,0x74,0x65,0x70,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x6f,0x66,0x66,0x73,0x65,0x74,0x5f,0x78,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x67,0x78,0x5f,0x6d,0x61,0x78,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x63,0x68,0x61,0x6e,0x6e,0x65,0x6c,0x73,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x61,0x6c,0x70,0x68,0x61,0x77,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x61,0x6c,0x70,0x68,0x61,0x68,0x3b,0x0d,0x0a,0x7d,0x20,0x70,0x3b,0x0d,0x0a,0x0d,0x0a,0x76,0x6f,0x69,0x64,0x20,0x6d,0x61,0x69,0x6e,0x28,0x29,0x0d,0x0a,0x7b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x67,0x78,0x20,0x3d,0x20,0x69,0x6e,0x74,0x28,0x67,0x6c,0x5f,0x47,0x6c,0x6f,0x62,0x61,0x6c,0x49,0x6e,0x76,0x6f,0x63,0x61,0x74,0x69,0x6f,0x6e,0x49,0x44,0x2e,0x78,0x29,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x67,0x79,0x20,0x3d,0x20,0x69,0x6e,0x74,0x28,0x67,0x6c,0x5f,0x47,0x6c,0x6f,0x62,0x61,0x6c,0x49,0x6e,0x76,0x6f,0x63,0x61,0x74,0x69,0x6f,0x6e,0x49,0x44,0x2e,0x79,0x29,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x67,0x7a,0x20,0x3d,0x20,0x69,0x6e,0x74,0x28,0x67,0x6c,0x5f,0x47,0x6c,0x6f,0x62,0x61,0x6c,0x49,0x6e,0x76,0x6f,0x63,0x61,0x74,0x69,0x6f,0x6e,0x49,0x44,0x2e,0x7a,0x29,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x66,0x20,0x28,0x67,0x78,0x20,0x3e,0x3d,0x20,0x70,0x2e,0x67,0x78,0x5f,0x6d,0x61,0x78,0x20,0x7c,0x7c,0x20,0x67,0x79,0x20,0x3e,0x3d,0x20,0x70,0x2e,0x6f,0x75,0x74,0x68,0x20,0x7c,0x7c,0x20,0x67,0x7a,0x20,0x3e,0x3d,0x20,0x70,0x2e,0x63,0x68,0x61,0x6e,0x6e,0x65,0x6c,0x73,0x29,0x0d,0x0a,0x72,0x65,0x74,0x75,0x72,0x6e,0x3b,0x0d,0x0a,0x0d,0x0a,0x66,0x6c,0x6f,0x61,0x74,0x20,0x76,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x66,0x20,0x28,0x67,0x7a,0x20,0x3d,0x3d,0x20,0x33,0x29,0x0d,0x0a,0x7b,0x0d,0x0a,0x76,0x20,0x3d,0x20,0x66,0x6c,0x6f,0x61,0x74,0x28,0x61,0x6c,0x70,0x68,0x61,0x5f,0x62,0x6c,0x6f,0x62,0x5f,0x64,0x61,0x74,0x61,0x5b,0x67,0x79,0x20,0x2a,0x20,0x70,0x2e,0x61,0x6c,0x70,0x68,0x61,0x77,0x20,0x2b,0x20,0x67,0x78,0x5d,0x29,0x3b,0x0d,0x0a,0x7d,0x0d,0x0a,0x65,0x6c,0x73,0x65,0x0d,0x0a,0x7b,0x0d,0x0a,0x76,0x20,0x3d,0x20,0x66,0x6c,0x6f,0x61,0x74,0x28,0x62,0x6f,0x74,0x74,0x6f,0x6d,0x5f,0x62,0x6c,0x6f,0x62,0x5f,0x64,0x61,0x74,0x61,0x5b,0x67,0x7a,0x20,0x2a,0x20,0x70,0x2e,0x63,0x73,0x74,0x65,0x70,0x20,0x2b,0x20,0x67,0x79,0x20,0x2a,0x20,0x70,0x2e,0x77,0x20,0x2b,0x20,0x67,0x78,0x5d,0x29,0x3b,0x0d,0x0a,0x7d,0x0d,0x0a,0x0d,0x0a,0x63,0x6f,0x6e,0x73,0x74,0x20,0x66,0x6c,0x6f,0x61,0x74,0x20,0x63,0x6c,0x69,0x70,0x5f,0x65,0x70,0x73,0x20,0x3d,0x20,0x30,0x2e,0x35,0x66,0x20,0x2f,0x20,0x32,0x35,0x35,0x2e,0x66,0x3b,0x0d,0x0a,0x0d,0x0a,0x76,0x20,0x3d,0x20,0x76,0x20,0x2b,0x20,0x63,0x6c,0x69,0x70,0x5f,0x65,0x70,0x73,0x3b,0x0d,0x0a,0x0d,0x0a,0x23,0x69,0x66,0x20,0x4e,0x43,0x4e,0x4e,0x5f,0x69,0x6e,0x74,0x38,0x5f,0x73,0x74,0x6f,0x72,0x61,0x67,0x65,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x76,0x5f,0x6f,0x66,0x66,0x73,0x65,0x74,0x20,0x3d,0x20,0x67,0x79,0x20,0x2a,0x20,0x70,0x2e,0x6f,0x75,0x74,0x77,0x20,0x2b,0x20,0x67,0x78,0x20,0x2b,0x20,0x70,0x2e,0x6f,0x66,0x66,0x73,0x65,0x74,0x5f,0x78,0x3b,0x0d,0x0a,0x0d,0x0a,0x75,0x69,0x6e,0x74,0x20,0x76,0x33,0x32,0x20,0x3d,0x20,0x63,0x6c,0x61,0x6d,0x70,0x28,0x75,0x69,0x6e,0x74,0x28,0x66,0x6c,0x6f,0x6f,0x72,0x28,0x76,0x29,0x29,0x2c,0x20,0x30,0x2c,0x20,0x32,0x35,0x35,0x29,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x66,0x20,0x28,0x62,0x67,0x72,0x20,0x3d,0x3d,0x20,0x31,0x20,0x26,0x26,0x20,0x67,0x7a,0x20,0x21,0x3d,0x20,0x33,0x29,0x0d,0x0a,0x74,0x6f,0x70,0x5f,0x62,0x6c,0x6f,0x62,0x5f,0x64,0x61,0x74,0x61,0x5b,0x76,0x5f,0x6f,0x66,0x66,0x73,0x65,0x74,0x20,0x2a,0x20,0x70,0x2e,0x63,0x68,0x61,0x6e,0x6e,0x65,0x6c,0x73,0x20,0x2b,0x20,0x32,0x20,0x2d,0x20,0x67,0x7a,0x5d,0x20,0x3d,0x20,0x75,0x69,0x6e,0x74,0x38,0x5f,0x74,0x28,0x76,0x33,0x32,0x29,0x3b,0x0d,0x0a,0x65,0x6c,0x73,0x65,0x0d,0x0a,0x74,0x6f,0x70,0x5f,0x62,0x6c,0x6f,0x62,0x5f,0x64,0x61,0x74,0x61,0x5b,0x76,0x5f,0x6f,0x66,0x66,0x73,0x65,0x74,0x20,0x2a,0x20,0x70,0x2e,0x63,0x68,0x61,0x6e,0x6e,0x65,0x6c,0x73,0x20,0x2b,0x20,0x67,0x7a,0x5d,0x20,0x3d,0x20,0x75,0x69,0x6e,0x74,0x38,0x5f,0x74,0x28,0x76,0x33,0x32,0x29,0x3b,0x0d,0x0a,0x23,0x65,0x6c,0x73,0x65,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x76,0x5f,0x6f,0x66,0x66,0x73,0x65,0x74,0x20,0x3d,0x20,0x67,0x7a,0x20,0x2a,0x20,0x70,0x2e,0x6f,0x75,0x74,0x63,0x73,0x74,0x65,0x70,0x20,0x2b,0x20,0x67,0x79,0x20,0x2a,0x20,0x70,0x2e,0x6f,0x75,0x74,0x77,0x20,0x2b,0x20,0x67,0x78,0x20,0x2b,0x20,0x70,0x2e,0x6f,0x66,0x66,0x73,0x65,0x74,0x5f,0x78,0x3b,0x0d,0x0a,0x0d,0x0a,0x74,0x6f,0x70,0x5f,0x62,0x6c,0x6f,0x62,0x5f,0x64,0x61,0x74,0x61,0x5b,0x76,0x5f,0x6f,0x66,0x66,0x73,0x65,0x74,0x5d,0x20,0x3d,0x20,0x76,0x3b,0x0d,0x0a,0x23,0x65,0x6e,0x64,0x69,0x66,0x0d,0x0a,0x7d,0x0d,0x0a };
+static const char waifu2x_postproc_comp_data[] = { 0x23,0x76,0x65,0x72,0x73,0x69,0x6f,0x6e,0x20,0x34,0x35,0x30,0x0d,0x0a,0x0d,0x0a,0x23,0x69,0x66,0x20,0x4e,0x43,0x4e,0x4e,0x5f,0x66,0x70,0x31,0x36,0x5f,0x73,0x74,0x6f,0x72,0x61,0x67,0x65,0x0d,0x0a,0x23,0x65,0x78,0x74,0x65,0x6e,0x73,0x69,0x6f,0x6e,0x20,0x47,0x4c,0x5f,0x45,0x58,0x54,0x5f,0x73,0x68,0x61,0x64,0x65,0x72,0x5f,0x31,0x36,0x62,0x69,0x74,0x5f,0x73,0x74,0x6f,0x72,0x61,0x67,0x65,0x3a,0x20,0x72,0x65,0x71,0x75,0x69,0x72,0x65,0x0d,0x0a,0x23,0x64,0x65,0x66,0x69,0x6e,0x65,0x20,0x73,0x66,0x70,0x20,0x66,0x6c,0x6f,0x61,0x74,0x31,0x36,0x5f,0x74,0x0d,0x0a,0x23,0x65,0x6c,0x73,0x65,0x0d,0x0a,0x23,0x64,0x65,0x66,0x69,0x6e,0x65,0x20,0x73,0x66,0x70,0x20,0x66,0x6c,0x6f,0x61,0x74,0x0d,0x0a,0x23,0x65,0x6e,0x64,0x69,0x66,0x0d,0x0a,0x0d,0x0a,0x6c,0x61,0x79,0x6f,0x75,0x74,0x20,0x28,0x63,0x6f,0x6e,0x73,0x74,0x61,0x6e,0x74,0x5f,0x69,0x64,0x20,0x3d,0x20,0x30,0x29,0x20,0x63,0x6f,0x6e,0x73,0x74,0x20,0x69,0x6e,0x74,0x20,0x62,0x67,0x72,0x20,0x3d,0x20,0x30,0x3b,0x0d,0x0a,0x6c,0x61,0x79,0x6f,0x75,0x74,0x20,0x28,0x63,0x6f,0x6e,0x73,0x74,0x61,0x6e,0x74,0x5f,0x69,0x64,0x20,0x3d,0x20,0x31,0x29,0x20,0x63,0x6f,0x6e,0x73,0x74,0x20,0x69,0x6e,0x74,0x20,0x62,0x79,0x74,0x65,0x73,0x20,0x3d,0x20,0x34,0x3b,0x0d,0x0a,0x6c,0x61,0x79,0x6f,0x75,0x74,0x20,0x28,0x63,0x6f,0x6e,0x73,0x74,0x61,0x6e,0x74,0x5f,0x69,0x64,0x20,0x3d,0x20,0x32,0x29,0x20,0x63,0x6f,0x6e,0x73,0x74,0x20,0x69,0x6e,0x74,0x20,0x79,0x75,0x76,0x20,0x3d,0x20,0x30,0x3b,0x0d,0x0a,0x6c,0x61,0x79,0x6f,0x75,0x74,0x20,0x28,0x63,0x6f,0x6e,0x73,0x74,0x61,0x6e,0x74,0x5f,0x69,0x64,0x20,0x3d,0x20,0x33,0x29,0x20,0x63,0x6f,0x6e,0x73,0x74,0x20,0x69,0x6e,0x74,0x20,0x68,0x61,0x6c,0x66,0x20,0x3d,0x20,0x30,0x3b,0x0d,0x0a,0x0d,0x0a,0x6c,0x61,0x79,0x6f,0x75,0x74,0x20,0x28,0x62,0x69,0x6e,0x64,0x69,0x6e,0x67,0x20,0x3d,0x20,0x30,0x29,0x20,0x72,0x65,0x61,0x64,0x6f,0x6e,0x6c,0x79,0x20,0x62,0x75,0x66,0x66,0x65,0x72,0x20,0x62,0x6f,0x74,0x74,0x6f,0x6d,0x5f,0x62,0x6c,0x6f,0x62,0x20,0x7b,0x20,0x73,0x66,0x70,0x20,0x62,0x6f,0x74,0x74,0x6f,0x6d,0x5f,0x62,0x6c,0x6f,0x62,0x5f,0x64,0x61,0x74,0x61,0x5b,0x5d,0x3b,0x20,0x7d,0x3b,0x0d,0x0a,0x6c,0x61,0x79,0x6f,0x75,0x74,0x20,0x28,0x62,0x69,0x6e,0x64,0x69,0x6e,0x67,0x20,0x3d,0x20,0x31,0x29,0x20,0x72,0x65,0x61,0x64,0x6f,0x6e,0x6c,0x79,0x20,0x62,0x75,0x66,0x66,0x65,0x72,0x20,0x61,0x6c,0x70,0x68,0x61,0x5f,0x62,0x6c,0x6f,0x62,0x20,0x7b,0x20,0x73,0x66,0x70,0x20,0x61,0x6c,0x70,0x68,0x61,0x5f,0x62,0x6c,0x6f,0x62,0x5f,0x64,0x61,0x74,0x61,0x5b,0x5d,0x3b,0x20,0x7d,0x3b,0x0d,0x0a,0x6c,0x61,0x79,0x6f,0x75,0x74,0x20,0x28,0x62,0x69,0x6e,0x64,0x69,0x6e,0x67,0x20,0x3d,0x20,0x32,0x29,0x20,0x77,0x72,0x69,0x74,0x65,0x6f,0x6e,0x6c,0x79,0x20,0x62,0x75,0x66,0x66,0x65,0x72,0x20,0x74,0x6f,0x70,0x5f,0x62,0x6c,0x6f,0x62,0x20,0x7b,0x20,0x75,0x69,0x6e,0x74,0x20,0x74,0x6f,0x70,0x5f,0x62,0x6c,0x6f,0x62,0x5f,0x64,0x61,0x74,0x61,0x5b,0x5d,0x3b,0x20,0x7d,0x3b,0x0d,0x0a,0x0d,0x0a,0x6c,0x61,0x79,0x6f,0x75,0x74,0x20,0x28,0x70,0x75,0x73,0x68,0x5f,0x63,0x6f,0x6e,0x73,0x74,0x61,0x6e,0x74,0x29,0x20,0x75,0x6e,0x69,0x66,0x6f,0x72,0x6d,0x20,0x70,0x61,0x72,0x61,0x6d,0x65,0x74,0x65,0x72,0x0d,0x0a,0x7b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x77,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x68,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x63,0x73,0x74,0x65,0x70,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x6f,0x75,0x74,0x77,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x6f,0x75,0x74,0x68,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x6f,0x75,0x74,0x63,0x73,0x74,0x65,0x70,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x6f,0x66,0x66,0x73,0x65,0x74,0x5f,0x78,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x67,0x78,0x5f,0x6d,0x61,0x78,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x63,0x68,0x61,0x6e,0x6e,0x65,0x6c,0x73,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x61,0x6c,0x70,0x68,0x61,0x77,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x61,0x6c,0x70,0x68,0x61,0x68,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x6f,0x75,0x74,0x73,0x74,0x72,0x69,0x64,0x65,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x6f,0x75,0x74,0x75,0x76,0x73,0x74,0x72,0x69,0x64,0x65,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x6f,0x66,0x66,0x73,0x65,0x74,0x5f,0x79,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x6d,0x61,0x78,0x76,0x3b,0x0d,0x0a,0x0d,0x0a,0x66,0x6c,0x6f,0x61,0x74,0x20,0x6b,0x72,0x3b,0x0d,0x0a,0x66,0x6c,0x6f,0x61,0x74,0x20,0x6b,0x62,0x3b,0x0d,0x0a,0x66,0x6c,0x6f,0x61,0x74,0x20,0x79,0x6d,0x75,0x6c,0x3b,0x0d,0x0a,0x66,0x6c,0x6f,0x61,0x74,0x20,0x79,0x61,0x64,0x64,0x3b,0x0d,0x0a,0x66,0x6c,0x6f,0x61,0x74,0x20,0x63,0x6d,0x75,0x6c,0x3b,0x0d,0x0a,0x66,0x6c,0x6f,0x61,0x74,0x20,0x63,0x61,0x64,0x64,0x3b,0x0d,0x0a,0x0d,0x0a,0x2f,0x2f,0x20,0x74,0x68,0x65,0x20,0x66,0x69,0x72,0x73,0x74,0x20,0x72,0x6f,0x77,0x20,0x6f,0x66,0x20,0x74,0x68,0x65,0x20,0x74,0x69,0x6c,0x65,0x20,0x69,0x6e,0x20,0x74,0x6f,0x70,0x5f,0x62,0x6c,0x6f,0x62,0x2c,0x20,0x30,0x20,0x66,0x6f,0x72,0x20,0x74,0x68,0x65,0x20,0x73,0x74,0x61,0x67,0x69,0x6e,0x67,0x20,0x72,0x6f,0x77,0x73,0x2c,0x20,0x74,0x68,0x65,0x20,0x74,0x69,0x6c,0x65,0x20,0x72,0x6f,0x77,0x20,0x69,0x6e,0x20,0x74,0x68,0x65,0x20,0x66,0x6c,0x6f,0x61,0x74,0x20,0x52,0x47,0x42,0x20,0x66,0x72,0x61,0x6d,0x65,0x73,0x20,0x62,0x65,0x74,0x77,0x65,0x65,0x6e,0x20,0x70,0x61,0x73,0x73,0x65,0x73,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x79,0x30,0x3b,0x0d,0x0a,0x7d,0x20,0x70,0x3b,0x0d,0x0a,0x0d,0x0a,0x2f,0x2f,0x20,0x6e,0x6f,0x72,0x6d,0x61,0x6c,0x69,0x7a,0x65,0x64,0x20,0x52,0x2c,0x20,0x47,0x20,0x6f,0x72,0x20,0x42,0x20,0x6f,0x66,0x20,0x74,0x68,0x65,0x20,0x6e,0x65,0x74,0x77,0x6f,0x72,0x6b,0x20,0x6f,0x75,0x74,0x70,0x75,0x74,0x20,0x61,0x74,0x20,0x78,0x2c,0x20,0x79,0x20,0x6f,0x66,0x20,0x74,0x68,0x69,0x73,0x20,0x74,0x69,0x6c,0x65,0x0d,0x0a,0x66,0x6c,0x6f,0x61,0x74,0x20,0x72,0x67,0x62,0x28,0x69,0x6e,0x74,0x20,0x67,0x7a,0x2c,0x20,0x69,0x6e,0x74,0x20,0x78,0x2c,0x20,0x69,0x6e,0x74,0x20,0x79,0x29,0x0d,0x0a,0x7b,0x0d,0x0a,0x72,0x65,0x74,0x75,0x72,0x6e,0x20,0x66,0x6c,0x6f,0x61,0x74,0x28,0x62,0x6f,0x74,0x74,0x6f,0x6d,0x5f,0x62,0x6c,0x6f,0x62,0x5f,0x64,0x61,0x74,0x61,0x5b,0x67,0x7a,0x20,0x2a,0x20,0x70,0x2e,0x63,0x73,0x74,0x65,0x70,0x20,0x2b,0x20,0x79,0x20,0x2a,0x20,0x70,0x2e,0x77,0x20,0x2b,0x20,0x78,0x5d,0x29,0x3b,0x0d,0x0a,0x7d,0x0d,0x0a,0x0d,0x0a,0x2f,0x2f,0x20,0x6e,0x6f,0x72,0x6d,0x61,0x6c,0x69,0x7a,0x65,0x64,0x20,0x76,0x61,0x6c,0x75,0x65,0x20,0x6f,0x66,0x20,0x70,0x6c,0x61,0x6e,0x65,0x20,0x67,0x7a,0x20,0x61,0x74,0x20,0x78,0x2c,0x20,0x79,0x20,0x6f,0x66,0x20,0x74,0x68,0x69,0x73,0x20,0x74,0x69,0x6c,0x65,0x2c,0x20,0x78,0x20,0x61,0x6e,0x64,0x20,0x79,0x20,0x61,0x72,0x65,0x20,0x69,0x6e,0x20,0x75,0x6e,0x69,0x74,0x73,0x20,0x6f,0x66,0x20,0x74,0x68,0x61,0x74,0x20,0x70,0x6c,0x61,0x6e,0x65,0x0d,0x0a,0x66,0x6c,0x6f,0x61,0x74,0x20,0x70,0x6c,0x61,0x6e,0x65,0x28,0x69,0x6e,0x74,0x20,0x67,0x7a,0x2c,0x20,0x69,0x6e,0x74,0x20,0x78,0x2c,0x20,0x69,0x6e,0x74,0x20,0x79,0x29,0x0d,0x0a,0x7b,0x0d,0x0a,0x69,0x66,0x20,0x28,0x79,0x75,0x76,0x20,0x3d,0x3d,0x20,0x30,0x29,0x0d,0x0a,0x72,0x65,0x74,0x75,0x72,0x6e,0x20,0x72,0x67,0x62,0x28,0x67,0x7a,0x2c,0x20,0x78,0x2c,0x20,0x79,0x29,0x3b,0x0d,0x0a,0x0d,0x0a,0x66,0x6c,0x6f,0x61,0x74,0x20,0x72,0x3b,0x0d,0x0a,0x66,0x6c,0x6f,0x61,0x74,0x20,0x67,0x3b,0x0d,0x0a,0x66,0x6c,0x6f,0x61,0x74,0x20,0x62,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x66,0x20,0x28,0x79,0x75,0x76,0x20,0x3d,0x3d,0x20,0x32,0x20,0x26,0x26,0x20,0x67,0x7a,0x20,0x21,0x3d,0x20,0x30,0x29,0x0d,0x0a,0x7b,0x0d,0x0a,0x2f,0x2f,0x20,0x34,0x3a,0x32,0x3a,0x30,0x2c,0x20,0x61,0x76,0x65,0x72,0x61,0x67,0x65,0x20,0x6f,0x66,0x20,0x74,0x68,0x65,0x20,0x32,0x78,0x32,0x20,0x62,0x6c,0x6f,0x63,0x6b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x78,0x30,0x20,0x3d,0x20,0x78,0x20,0x2a,0x20,0x32,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x79,0x30,0x20,0x3d,0x20,0x79,0x20,0x2a,0x20,0x32,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x78,0x31,0x20,0x3d,0x20,0x6d,0x69,0x6e,0x28,0x78,0x30,0x20,0x2b,0x20,0x31,0x2c,0x20,0x70,0x2e,0x67,0x78,0x5f,0x6d,0x61,0x78,0x20,0x2d,0x20,0x31,0x29,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x79,0x31,0x20,0x3d,0x20,0x6d,0x69,0x6e,0x28,0x79,0x30,0x20,0x2b,0x20,0x31,0x2c,0x20,0x70,0x2e,0x6f,0x75,0x74,0x68,0x20,0x2d,0x20,0x31,0x29,0x3b,0x0d,0x0a,0x0d,0x0a,0x72,0x20,0x3d,0x20,0x28,0x72,0x67,0x62,0x28,0x30,0x2c,0x20,0x78,0x30,0x2c,0x20,0x79,0x30,0x29,0x20,0x2b,0x20,0x72,0x67,0x62,0x28,0x30,0x2c,0x20,0x78,0x31,0x2c,0x20,0x79,0x30,0x29,0x20,0x2b,0x20,0x72,0x67,0x62,0x28,0x30,0x2c,0x20,0x78,0x30,0x2c,0x20,0x79,0x31,0x29,0x20,0x2b,0x20,0x72,0x67,0x62,0x28,0x30,0x2c,0x20,0x78,0x31,0x2c,0x20,0x79,0x31,0x29,0x29,0x20,0x2a,0x20,0x30,0x2e,0x32,0x35,0x66,0x3b,0x0d,0x0a,0x67,0x20,0x3d,0x20,0x28,0x72,0x67,0x62,0x28,0x31,0x2c,0x20,0x78,0x30,0x2c,0x20,0x79,0x30,0x29,0x20,0x2b,0x20,0x72,0x67,0x62,0x28,0x31,0x2c,0x20,0x78,0x31,0x2c,0x20,0x79,0x30,0x29,0x20,0x2b,0x20,0x72,0x67,0x62,0x28,0x31,0x2c,0x20,0x78,0x30,0x2c,0x20,0x79,0x31,0x29,0x20,0x2b,0x20,0x72,0x67,0x62,0x28,0x31,0x2c,0x20,0x78,0x31,0x2c,0x20,0x79,0x31,0x29,0x29,0x20,0x2a,0x20,0x30,0x2e,0x32,0x35,0x66,0x3b,0x0d,0x0a,0x62,0x20,0x3d,0x20,0x28,0x72,0x67,0x62,0x28,0x32,0x2c,0x20,0x78,0x30,0x2c,0x20,0x79,0x30,0x29,0x20,0x2b,0x20,0x72,0x67,0x62,0x28,0x32,0x2c,0x20,0x78,0x31,0x2c,0x20,0x79,0x30,0x29,0x20,0x2b,0x20,0x72,0x67,0x62,0x28,0x32,0x2c,0x20,0x78,0x30,0x2c,0x20,0x79,0x31,0x29,0x20,0x2b,0x20,0x72,0x67,0x62,0x28,0x32,0x2c,0x20,0x78,0x31,0x2c,0x20,0x79,0x31,0x29,0x29,0x20,0x2a,0x20,0x30,0x2e,0x32,0x35,0x66,0x3b,0x0d,0x0a,0x7d,0x0d,0x0a,0x65,0x6c,0x73,0x65,0x0d,0x0a,0x7b,0x0d,0x0a,0x72,0x20,0x3d,0x20,0x72,0x67,0x62,0x28,0x30,0x2c,0x20,0x78,0x2c,0x20,0x79,0x29,0x3b,0x0d,0x0a,0x67,0x20,0x3d,0x20,0x72,0x67,0x62,0x28,0x31,0x2c,0x20,0x78,0x2c,0x20,0x79,0x29,0x3b,0x0d,0x0a,0x62,0x20,0x3d,0x20,0x72,0x67,0x62,0x28,0x32,0x2c,0x20,0x78,0x2c,0x20,0x79,0x29,0x3b,0x0d,0x0a,0x7d,0x0d,0x0a,0x0d,0x0a,0x66,0x6c,0x6f,0x61,0x74,0x20,0x59,0x20,0x3d,0x20,0x70,0x2e,0x6b,0x72,0x20,0x2a,0x20,0x72,0x20,0x2b,0x20,0x28,0x31,0x2e,0x66,0x20,0x2d,0x20,0x70,0x2e,0x6b,0x72,0x20,0x2d,0x20,0x70,0x2e,0x6b,0x62,0x29,0x20,0x2a,0x20,0x67,0x20,0x2b,0x20,0x70,0x2e,0x6b,0x62,0x20,0x2a,0x20,0x62,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x66,0x20,0x28,0x67,0x7a,0x20,0x3d,0x3d,0x20,0x30,0x29,0x0d,0x0a,0x72,0x65,0x74,0x75,0x72,0x6e,0x20,0x59,0x3b,0x0d,0x0a,0x69,0x66,0x20,0x28,0x67,0x7a,0x20,0x3d,0x3d,0x20,0x31,0x29,0x0d,0x0a,0x72,0x65,0x74,0x75,0x72,0x6e,0x20,0x28,0x62,0x20,0x2d,0x20,0x59,0x29,0x20,0x2f,0x20,0x28,0x32,0x2e,0x66,0x20,0x2a,0x20,0x28,0x31,0x2e,0x66,0x20,0x2d,0x20,0x70,0x2e,0x6b,0x62,0x29,0x29,0x3b,0x0d,0x0a,0x72,0x65,0x74,0x75,0x72,0x6e,0x20,0x28,0x72,0x20,0x2d,0x20,0x59,0x29,0x20,0x2f,0x20,0x28,0x32,0x2e,0x66,0x20,0x2a,0x20,0x28,0x31,0x2e,0x66,0x20,0x2d,0x20,0x70,0x2e,0x6b,0x72,0x29,0x29,0x3b,0x0d,0x0a,0x7d,0x0d,0x0a,0x0d,0x0a,0x63,0x6f,0x6e,0x73,0x74,0x20,0x66,0x6c,0x6f,0x61,0x74,0x20,0x62,0x61,0x79,0x65,0x72,0x5b,0x31,0x36,0x5d,0x20,0x3d,0x20,0x66,0x6c,0x6f,0x61,0x74,0x5b,0x31,0x36,0x5d,0x28,0x30,0x2e,0x66,0x2c,0x20,0x38,0x2e,0x66,0x2c,0x20,0x32,0x2e,0x66,0x2c,0x20,0x31,0x30,0x2e,0x66,0x2c,0x20,0x31,0x32,0x2e,0x66,0x2c,0x20,0x34,0x2e,0x66,0x2c,0x20,0x31,0x34,0x2e,0x66,0x2c,0x20,0x36,0x2e,0x66,0x2c,0x20,0x33,0x2e,0x66,0x2c,0x20,0x31,0x31,0x2e,0x66,0x2c,0x20,0x31,0x2e,0x66,0x2c,0x20,0x39,0x2e,0x66,0x2c,0x20,0x31,0x35,0x2e,0x66,0x2c,0x20,0x37,0x2e,0x66,0x2c,0x20,0x31,0x33,0x2e,0x66,0x2c,0x20,0x35,0x2e,0x66,0x29,0x3b,0x0d,0x0a,0x0d,0x0a,0x76,0x6f,0x69,0x64,0x20,0x6d,0x61,0x69,0x6e,0x28,0x29,0x0d,0x0a,0x7b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x67,0x78,0x20,0x3d,0x20,0x69,0x6e,0x74,0x28,0x67,0x6c,0x5f,0x47,0x6c,0x6f,0x62,0x61,0x6c,0x49,0x6e,0x76,0x6f,0x63,0x61,0x74,0x69,0x6f,0x6e,0x49,0x44,0x2e,0x78,0x29,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x67,0x79,0x20,0x3d,0x20,0x69,0x6e,0x74,0x28,0x67,0x6c,0x5f,0x47,0x6c,0x6f,0x62,0x61,0x6c,0x49,0x6e,0x76,0x6f,0x63,0x61,0x74,0x69,0x6f,0x6e,0x49,0x44,0x2e,0x79,0x29,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x67,0x7a,0x20,0x3d,0x20,0x69,0x6e,0x74,0x28,0x67,0x6c,0x5f,0x47,0x6c,0x6f,0x62,0x61,0x6c,0x49,0x6e,0x76,0x6f,0x63,0x61,0x74,0x69,0x6f,0x6e,0x49,0x44,0x2e,0x7a,0x29,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x66,0x20,0x28,0x67,0x7a,0x20,0x3e,0x3d,0x20,0x70,0x2e,0x63,0x68,0x61,0x6e,0x6e,0x65,0x6c,0x73,0x29,0x0d,0x0a,0x72,0x65,0x74,0x75,0x72,0x6e,0x3b,0x0d,0x0a,0x0d,0x0a,0x2f,0x2f,0x20,0x65,0x76,0x65,0x72,0x79,0x20,0x69,0x6e,0x76,0x6f,0x63,0x61,0x74,0x69,0x6f,0x6e,0x20,0x77,0x72,0x69,0x74,0x65,0x73,0x20,0x6f,0x6e,0x65,0x20,0x33,0x32,0x2d,0x62,0x69,0x74,0x20,0x77,0x6f,0x72,0x64,0x2c,0x20,0x74,0x68,0x61,0x74,0x20,0x69,0x73,0x20,0x34,0x20,0x2f,0x20,0x62,0x79,0x74,0x65,0x73,0x20,0x63,0x6f,0x6d,0x70,0x6f,0x6e,0x65,0x6e,0x74,0x73,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x70,0x70,0x77,0x20,0x3d,0x20,0x34,0x20,0x2f,0x20,0x62,0x79,0x74,0x65,0x73,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x73,0x75,0x62,0x20,0x3d,0x20,0x28,0x79,0x75,0x76,0x20,0x3d,0x3d,0x20,0x32,0x20,0x26,0x26,0x20,0x67,0x7a,0x20,0x21,0x3d,0x20,0x30,0x20,0x26,0x26,0x20,0x67,0x7a,0x20,0x21,0x3d,0x20,0x33,0x29,0x20,0x3f,0x20,0x32,0x20,0x3a,0x20,0x31,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x70,0x77,0x20,0x3d,0x20,0x28,0x70,0x2e,0x67,0x78,0x5f,0x6d,0x61,0x78,0x20,0x2b,0x20,0x73,0x75,0x62,0x20,0x2d,0x20,0x31,0x29,0x20,0x2f,0x20,0x73,0x75,0x62,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x70,0x68,0x20,0x3d,0x20,0x70,0x2e,0x6f,0x75,0x74,0x68,0x20,0x2f,0x20,0x73,0x75,0x62,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x77,0x78,0x20,0x3d,0x20,0x67,0x78,0x20,0x2a,0x20,0x70,0x70,0x77,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x66,0x20,0x28,0x77,0x78,0x20,0x3e,0x3d,0x20,0x70,0x77,0x20,0x7c,0x7c,0x20,0x67,0x79,0x20,0x3e,0x3d,0x20,0x70,0x68,0x29,0x0d,0x0a,0x72,0x65,0x74,0x75,0x72,0x6e,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x73,0x74,0x72,0x69,0x64,0x65,0x20,0x3d,0x20,0x73,0x75,0x62,0x20,0x3d,0x3d,0x20,0x32,0x20,0x3f,0x20,0x70,0x2e,0x6f,0x75,0x74,0x75,0x76,0x73,0x74,0x72,0x69,0x64,0x65,0x20,0x3a,0x20,0x70,0x2e,0x6f,0x75,0x74,0x73,0x74,0x72,0x69,0x64,0x65,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x76,0x5f,0x6f,0x66,0x66,0x73,0x65,0x74,0x20,0x3d,0x20,0x67,0x7a,0x20,0x2a,0x20,0x70,0x2e,0x6f,0x75,0x74,0x63,0x73,0x74,0x65,0x70,0x20,0x2b,0x20,0x28,0x70,0x2e,0x79,0x30,0x20,0x2f,0x20,0x73,0x75,0x62,0x20,0x2b,0x20,0x67,0x79,0x29,0x20,0x2a,0x20,0x73,0x74,0x72,0x69,0x64,0x65,0x20,0x2b,0x20,0x70,0x2e,0x6f,0x66,0x66,0x73,0x65,0x74,0x5f,0x78,0x20,0x2f,0x20,0x73,0x75,0x62,0x20,0x2b,0x20,0x77,0x78,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x66,0x20,0x28,0x62,0x79,0x74,0x65,0x73,0x20,0x3d,0x3d,0x20,0x34,0x29,0x0d,0x0a,0x7b,0x0d,0x0a,0x66,0x6c,0x6f,0x61,0x74,0x20,0x76,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x66,0x20,0x28,0x67,0x7a,0x20,0x3d,0x3d,0x20,0x33,0x29,0x0d,0x0a,0x76,0x20,0x3d,0x20,0x66,0x6c,0x6f,0x61,0x74,0x28,0x61,0x6c,0x70,0x68,0x61,0x5f,0x62,0x6c,0x6f,0x62,0x5f,0x64,0x61,0x74,0x61,0x5b,0x67,0x79,0x20,0x2a,0x20,0x70,0x2e,0x61,0x6c,0x70,0x68,0x61,0x77,0x20,0x2b,0x20,0x67,0x78,0x5d,0x29,0x3b,0x0d,0x0a,0x65,0x6c,0x73,0x65,0x0d,0x0a,0x76,0x20,0x3d,0x20,0x70,0x6c,0x61,0x6e,0x65,0x28,0x67,0x7a,0x2c,0x20,0x67,0x78,0x2c,0x20,0x67,0x79,0x29,0x3b,0x0d,0x0a,0x0d,0x0a,0x2f,0x2f,0x20,0x74,0x68,0x65,0x20,0x72,0x6f,0x75,0x6e,0x64,0x69,0x6e,0x67,0x20,0x6f,0x66,0x20,0x74,0x68,0x65,0x20,0x6f,0x72,0x69,0x67,0x69,0x6e,0x61,0x6c,0x20,0x38,0x2d,0x62,0x69,0x74,0x20,0x6f,0x75,0x74,0x70,0x75,0x74,0x2c,0x20,0x6b,0x65,0x70,0x74,0x20,0x66,0x6f,0x72,0x20,0x52,0x47,0x42,0x0d,0x0a,0x69,0x66,0x20,0x28,0x79,0x75,0x76,0x20,0x3d,0x3d,0x20,0x30,0x20,0x26,0x26,0x20,0x67,0x7a,0x20,0x21,0x3d,0x20,0x33,0x29,0x0d,0x0a,0x7b,0x0d,0x0a,0x63,0x6f,0x6e,0x73,0x74,0x20,0x66,0x6c,0x6f,0x61,0x74,0x20,0x63,0x6c,0x69,0x70,0x5f,0x65,0x70,0x73,0x20,0x3d,0x20,0x30,0x2e,0x35,0x66,0x20,0x2f,0x20,0x32,0x35,0x35,0x2e,0x66,0x3b,0x0d,0x0a,0x0d,0x0a,0x76,0x20,0x3d,0x20,0x76,0x20,0x2b,0x20,0x63,0x6c,0x69,0x70,0x5f,0x65,0x70,0x73,0x3b,0x0d,0x0a,0x7d,0x0d,0x0a,0x0d,0x0a,0x74,0x6f,0x70,0x5f,0x62,0x6c,0x6f,0x62,0x5f,0x64,0x61,0x74,0x61,0x5b,0x76,0x5f,0x6f,0x66,0x66,0x73,0x65,0x74,0x5d,0x20,0x3d,0x20,0x66,0x6c,0x6f,0x61,0x74,0x42,0x69,0x74,0x73,0x54,0x6f,0x55,0x69,0x6e,0x74,0x28,0x76,0x29,0x3b,0x0d,0x0a,0x72,0x65,0x74,0x75,0x72,0x6e,0x3b,0x0d,0x0a,0x7d,0x0d,0x0a,0x0d,0x0a,0x62,0x6f,0x6f,0x6c,0x20,0x6c,0x75,0x6d,0x61,0x20,0x3d,0x20,0x67,0x7a,0x20,0x3d,0x3d,0x20,0x30,0x20,0x7c,0x7c,0x20,0x67,0x7a,0x20,0x3d,0x3d,0x20,0x33,0x20,0x7c,0x7c,0x20,0x79,0x75,0x76,0x20,0x3d,0x3d,0x20,0x30,0x3b,0x0d,0x0a,0x66,0x6c,0x6f,0x61,0x74,0x20,0x6d,0x75,0x6c,0x20,0x3d,0x20,0x6c,0x75,0x6d,0x61,0x20,0x3f,0x20,0x70,0x2e,0x79,0x6d,0x75,0x6c,0x20,0x3a,0x20,0x70,0x2e,0x63,0x6d,0x75,0x6c,0x3b,0x0d,0x0a,0x66,0x6c,0x6f,0x61,0x74,0x20,0x61,0x64,0x64,0x20,0x3d,0x20,0x6c,0x75,0x6d,0x61,0x20,0x3f,0x20,0x70,0x2e,0x79,0x61,0x64,0x64,0x20,0x3a,0x20,0x70,0x2e,0x63,0x61,0x64,0x64,0x3b,0x0d,0x0a,0x0d,0x0a,0x75,0x69,0x6e,0x74,0x20,0x77,0x6f,0x72,0x64,0x20,0x3d,0x20,0x30,0x3b,0x0d,0x0a,0x0d,0x0a,0x66,0x6f,0x72,0x20,0x28,0x69,0x6e,0x74,0x20,0x69,0x20,0x3d,0x20,0x30,0x3b,0x20,0x69,0x20,0x3c,0x20,0x70,0x70,0x77,0x3b,0x20,0x69,0x2b,0x2b,0x29,0x0d,0x0a,0x7b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x78,0x20,0x3d,0x20,0x6d,0x69,0x6e,0x28,0x77,0x78,0x20,0x2b,0x20,0x69,0x2c,0x20,0x70,0x77,0x20,0x2d,0x20,0x31,0x29,0x3b,0x0d,0x0a,0x0d,0x0a,0x66,0x6c,0x6f,0x61,0x74,0x20,0x76,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x66,0x20,0x28,0x68,0x61,0x6c,0x66,0x20,0x3d,0x3d,0x20,0x31,0x29,0x0d,0x0a,0x7b,0x0d,0x0a,0x69,0x66,0x20,0x28,0x67,0x7a,0x20,0x3d,0x3d,0x20,0x33,0x29,0x0d,0x0a,0x76,0x20,0x3d,0x20,0x66,0x6c,0x6f,0x61,0x74,0x28,0x61,0x6c,0x70,0x68,0x61,0x5f,0x62,0x6c,0x6f,0x62,0x5f,0x64,0x61,0x74,0x61,0x5b,0x67,0x79,0x20,0x2a,0x20,0x70,0x2e,0x61,0x6c,0x70,0x68,0x61,0x77,0x20,0x2b,0x20,0x78,0x5d,0x29,0x3b,0x0d,0x0a,0x65,0x6c,0x73,0x65,0x0d,0x0a,0x76,0x20,0x3d,0x20,0x70,0x6c,0x61,0x6e,0x65,0x28,0x67,0x7a,0x2c,0x20,0x78,0x2c,0x20,0x67,0x79,0x29,0x3b,0x0d,0x0a,0x0d,0x0a,0x69,0x66,0x20,0x28,0x79,0x75,0x76,0x20,0x3d,0x3d,0x20,0x30,0x20,0x26,0x26,0x20,0x67,0x7a,0x20,0x21,0x3d,0x20,0x33,0x29,0x0d,0x0a,0x7b,0x0d,0x0a,0x63,0x6f,0x6e,0x73,0x74,0x20,0x66,0x6c,0x6f,0x61,0x74,0x20,0x63,0x6c,0x69,0x70,0x5f,0x65,0x70,0x73,0x20,0x3d,0x20,0x30,0x2e,0x35,0x66,0x20,0x2f,0x20,0x32,0x35,0x35,0x2e,0x66,0x3b,0x0d,0x0a,0x0d,0x0a,0x76,0x20,0x3d,0x20,0x76,0x20,0x2b,0x20,0x63,0x6c,0x69,0x70,0x5f,0x65,0x70,0x73,0x3b,0x0d,0x0a,0x7d,0x0d,0x0a,0x0d,0x0a,0x77,0x6f,0x72,0x64,0x20,0x7c,0x3d,0x20,0x70,0x61,0x63,0x6b,0x48,0x61,0x6c,0x66,0x32,0x78,0x31,0x36,0x28,0x76,0x65,0x63,0x32,0x28,0x76,0x2c,0x20,0x30,0x2e,0x66,0x29,0x29,0x20,0x3c,0x3c,0x20,0x28,0x69,0x20,0x2a,0x20,0x31,0x36,0x29,0x3b,0x0d,0x0a,0x63,0x6f,0x6e,0x74,0x69,0x6e,0x75,0x65,0x3b,0x0d,0x0a,0x7d,0x0d,0x0a,0x0d,0x0a,0x69,0x66,0x20,0x28,0x67,0x7a,0x20,0x3d,0x3d,0x20,0x33,0x29,0x0d,0x0a,0x76,0x20,0x3d,0x20,0x66,0x6c,0x6f,0x61,0x74,0x28,0x61,0x6c,0x70,0x68,0x61,0x5f,0x62,0x6c,0x6f,0x62,0x5f,0x64,0x61,0x74,0x61,0x5b,0x67,0x79,0x20,0x2a,0x20,0x70,0x2e,0x61,0x6c,0x70,0x68,0x61,0x77,0x20,0x2b,0x20,0x78,0x5d,0x29,0x20,0x2a,0x20,0x66,0x6c,0x6f,0x61,0x74,0x28,0x70,0x2e,0x6d,0x61,0x78,0x76,0x29,0x3b,0x0d,0x0a,0x65,0x6c,0x73,0x65,0x0d,0x0a,0x76,0x20,0x3d,0x20,0x70,0x6c,0x61,0x6e,0x65,0x28,0x67,0x7a,0x2c,0x20,0x78,0x2c,0x20,0x67,0x79,0x29,0x20,0x2a,0x20,0x6d,0x75,0x6c,0x20,0x2b,0x20,0x61,0x64,0x64,0x3b,0x0d,0x0a,0x0d,0x0a,0x2f,0x2f,0x20,0x6f,0x72,0x64,0x65,0x72,0x65,0x64,0x20,0x64,0x69,0x74,0x68,0x65,0x72,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x64,0x78,0x20,0x3d,0x20,0x28,0x70,0x2e,0x6f,0x66,0x66,0x73,0x65,0x74,0x5f,0x78,0x20,0x2f,0x20,0x73,0x75,0x62,0x20,0x2b,0x20,0x77,0x78,0x20,0x2b,0x20,0x69,0x29,0x20,0x26,0x20,0x33,0x3b,0x0d,0x0a,0x69,0x6e,0x74,0x20,0x64,0x79,0x20,0x3d,0x20,0x28,0x70,0x2e,0x6f,0x66,0x66,0x73,0x65,0x74,0x5f,0x79,0x20,0x2f,0x20,0x73,0x75,0x62,0x20,0x2b,0x20,0x67,0x79,0x29,0x20,0x26,0x20,0x33,0x3b,0x0d,0x0a,0x0d,0x0a,0x76,0x20,0x3d,0x20,0x66,0x6c,0x6f,0x6f,0x72,0x28,0x76,0x20,0x2b,0x20,0x28,0x62,0x61,0x79,0x65,0x72,0x5b,0x64,0x79,0x20,0x2a,0x20,0x34,0x20,0x2b,0x20,0x64,0x78,0x5d,0x20,0x2b,0x20,0x30,0x2e,0x35,0x66,0x29,0x20,0x2f,0x20,0x31,0x36,0x2e,0x66,0x29,0x3b,0x0d,0x0a,0x0d,0x0a,0x75,0x69,0x6e,0x74,0x20,0x76,0x33,0x32,0x20,0x3d,0x20,0x75,0x69,0x6e,0x74,0x28,0x63,0x6c,0x61,0x6d,0x70,0x28,0x76,0x2c,0x20,0x30,0x2e,0x66,0x2c,0x20,0x66,0x6c,0x6f,0x61,0x74,0x28,0x70,0x2e,0x6d,0x61,0x78,0x76,0x29,0x29,0x29,0x3b,0x0d,0x0a,0x0d,0x0a,0x77,0x6f,0x72,0x64,0x20,0x7c,0x3d,0x20,0x76,0x33,0x32,0x20,0x3c,0x3c,0x20,0x28,0x69,0x20,0x2a,0x20,0x62,0x79,0x74,0x65,0x73,0x20,0x2a,0x20,0x38,0x29,0x3b,0x0d,0x0a,0x7d,0x0d,0x0a,0x0d,0x0a,0x74,0x6f,0x70,0x5f,0x62,0x6c,0x6f,0x62,0x5f,0x64,0x61,0x74,0x61,0x5b,0x76,0x5f,0x6f,0x66,0x66,0x73,0x65,0x74,0x20,0x2f,0x20,0x70,0x70,0x77,0x5d,0x20,0x3d,0x20,0x77,0x6f,0x72,0x64,0x3b,0x0d,0x0a,0x7d,0x0d,0x0a };
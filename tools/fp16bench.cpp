@@ -0,0 +1,72 @@
+// microbenchmark of the float <-> half conversion used by fp16_io
+// build: cl /O2 /EHsc /std:c++20 /I..\src /I<ncnn include> fp16bench.cpp ..\src\fp16.cpp ncnn.lib
+//    or: g++ -O2 -std=c++20 -I../src -I<ncnn include> fp16bench.cpp ../src/fp16.cpp -lncnn
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "fp16.h"
+
+template<typename F>
+static double bench(F&& f, const int iterations)
+{
+    f();
+
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        f();
+    const auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double>(end - start).count() / iterations;
+}
+
+int main(int argc, char** argv)
+{
+    // one 1920x1080 RGB frame by default
+    const size_t n = (argc > 1) ? std::strtoull(argv[1], nullptr, 10) : 1920 * 1080 * 3;
+    const int iterations = (argc > 2) ? std::atoi(argv[2]) : 100;
+
+    std::vector<float> src(n);
+    std::vector<float> back(n);
+    std::vector<uint16_t> half_c(n);
+    std::vector<uint16_t> half_simd(n);
+
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<float> dist(0.f, 1.f);
+    for (auto& v : src)
+        v = dist(rng);
+
+    const double f2h_c = bench([&]() { float_to_half_c(src.data(), half_c.data(), n); }, iterations);
+    const double f2h = bench([&]() { float_to_half(src.data(), half_simd.data(), n); }, iterations);
+    const double h2f_c = bench([&]() { half_to_float_c(half_c.data(), back.data(), n); }, iterations);
+    const double h2f = bench([&]() { half_to_float(half_c.data(), back.data(), n); }, iterations);
+
+    if (std::memcmp(half_c.data(), half_simd.data(), n * sizeof(uint16_t)))
+    {
+        std::printf("float_to_half differs from the scalar version\n");
+        return 1;
+    }
+
+    std::vector<float> back_c(n);
+    half_to_float_c(half_c.data(), back_c.data(), n);
+    if (std::memcmp(back_c.data(), back.data(), n * sizeof(float)))
+    {
+        std::printf("half_to_float differs from the scalar version\n");
+        return 1;
+    }
+
+    // GB/s of float data
+    const double gb = n * sizeof(float) / 1e9;
+
+    std::printf("%zu values, %d iterations\n", n, iterations);
+    std::printf("float_to_half_c  %8.3f ms  %6.2f GB/s\n", f2h_c * 1e3, gb / f2h_c);
+    std::printf("float_to_half    %8.3f ms  %6.2f GB/s\n", f2h * 1e3, gb / f2h);
+    std::printf("half_to_float_c  %8.3f ms  %6.2f GB/s\n", h2f_c * 1e3, gb / h2f_c);
+    std::printf("half_to_float    %8.3f ms  %6.2f GB/s\n", h2f * 1e3, gb / h2f);
+
+    return 0;
+}
@@ -0,0 +1,537 @@
+// benchmark of Waifu2x::process outside of AviSynth
+// build: msvc\w2xbench.vcxproj
+//    or: g++ -O2 -std=c++20 -fopenmp -I../src -I<ncnn include> w2xbench.cpp ../src/waifu2x.cpp ../src/fp16.cpp -lncnn -lvulkan -lglslang -lSPIRV ...
+//
+// w2xbench [options]
+//   --models <dir>       folder with the models-* folders (default: models)
+//   --gpu <id>           GPU device, -1 for the CPU backend (default: default device, or -1 without GPU)
+//   --model <list>       0: upconv_7_anime_style_art_rgb, 1: upconv_7_photo, 2: cunet (default: 2)
+//   --noise <list>       -1..3 (default: 0)
+//   --scale <list>       1, 2, 4 or 8 (default: 2)
+//   --tile <list>        WxH or W, 0 picks it like tile_w=0 (default: the frame size)
+//   --tta <list>         1, 2, 4 or 8 transforms (default: 1)
+//   --stack-tta <list>   0: one network pass per tta transform, 1: stacked where the model allows it (default: 1)
+//   --fp32 <list>        0 or 1 (default: 0)
+//   --threads <list>     frames processed at the same time, gpu_thread of the plugin (default: 2)
+//   --cpu-threads <n>    threads of the CPU backend (default: number of logical processors)
+//   --batch <n>          frames per process() call (default: 1)
+//   --whole-frame <n>    1: copy whole frames to and from device memory instead of tile rows (default: 0)
+//   --mmap <n>           0: read the weights into private memory, 1: map the model file (default: 1)
+//                        run it in separate processes to compare the load time and the peak RSS
+//   --size <WxH>         frame size (default: 640x360)
+//   --bits <n>           8..16 or 32 (default: 32)
+//   --yuv <n>            0: RGB, 1: YUV444, 2: YUV420 (default: 0)
+//   --input <file>       raw planar frames of the given size and format, read in a loop (default: synthetic frames)
+//   --frames <n>         frames measured per configuration (default: 30)
+//   --warmup <n>         frames processed before measuring (default: 2)
+//   --csv                print comma separated values
+//
+// lists are comma separated, every combination is run
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "waifu2x.h"
+
+struct Options
+{
+    std::filesystem::path models{ "models" };
+    int gpu{ -2 };
+    std::vector<int> model{ 2 };
+    std::vector<int> noise{ 0 };
+    std::vector<int> scale{ 2 };
+    std::vector<std::pair<int, int>> tile{ { -1, -1 } };
+    std::vector<int> tta{ 1 };
+    std::vector<int> stackTta{ 1 };
+    std::vector<int> fp32{ 0 };
+    std::vector<int> threads{ 2 };
+    int cpuThreads{ static_cast<int>((std::max)(std::thread::hardware_concurrency(), 1u)) };
+    int batch{ 1 };
+    bool wholeFrame{ false };
+    bool mmap{ true };
+    int width{ 640 };
+    int height{ 360 };
+    int bits{ 32 };
+    int yuv{ 0 };
+    std::string input;
+    int frames{ 30 };
+    int warmup{ 2 };
+    bool csv{ false };
+};
+
+static std::vector<int> parse_list(const char* s)
+{
+    std::vector<int> list;
+
+    for (const char* p = s; *p;)
+    {
+        char* end;
+        list.emplace_back(static_cast<int>(std::strtol(p, &end, 10)));
+        p = (*end == ',') ? end + 1 : end;
+
+        if (end == p && *p)
+            break;
+    }
+
+    return list;
+}
+
+static std::pair<int, int> parse_size(const char* s)
+{
+    char* end;
+    const int w = static_cast<int>(std::strtol(s, &end, 10));
+    const int h = (*end == 'x') ? static_cast<int>(std::strtol(end + 1, nullptr, 10)) : w;
+
+    return { w, h };
+}
+
+static size_t peak_host_memory()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc{};
+    GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+    return pmc.PeakWorkingSetSize;
+#else
+    rusage ru{};
+    getrusage(RUSAGE_SELF, &ru);
+    return static_cast<size_t>(ru.ru_maxrss) * 1024;
+#endif
+}
+
+// planes of one frame in the clip format, with the strides AviSynth would use
+struct Planes
+{
+    std::vector<uint8_t> data[3];
+    ptrdiff_t stride[3];
+    int rows[3];
+};
+
+static void create_planes(Planes& planes, const int w, const int h, const int size, const int yuv)
+{
+    for (int q = 0; q < 3; ++q)
+    {
+        const int sub = (yuv == 2 && q > 0) ? 2 : 1;
+
+        planes.stride[q] = (static_cast<ptrdiff_t>(w / sub) * size + 63) / 64 * 64 / size;
+        planes.rows[q] = h / sub;
+        planes.data[q].assign(planes.stride[q] * planes.rows[q] * size, 0);
+    }
+}
+
+// a gradient with some texture, so that nothing is trivially constant
+static void fill_synthetic(Planes& planes, const int w, const int h, const int bits, const int yuv, const int seed)
+{
+    const int size = (bits == 32) ? 4 : (bits > 8) ? 2 : 1;
+    const float maxv = (bits == 32) ? 1.f : static_cast<float>((1 << bits) - 1);
+    uint32_t rng = 0x9e3779b9u * (seed + 1);
+
+    for (int q = 0; q < 3; ++q)
+    {
+        const int sub = (yuv == 2 && q > 0) ? 2 : 1;
+
+        for (int y = 0; y < h / sub; ++y)
+        {
+            for (int x = 0; x < w / sub; ++x)
+            {
+                rng = rng * 1664525u + 1013904223u;
+
+                float v = (static_cast<float>(x * sub) / w + static_cast<float>(y * sub) / h) * 0.4f + (rng >> 24) / 255.f * 0.2f;
+                if (yuv && q > 0)
+                    v = 0.5f + (v - 0.5f) * 0.25f;
+
+                const ptrdiff_t i = y * planes.stride[q] + x;
+
+                if (size == 4)
+                    reinterpret_cast<float*>(planes.data[q].data())[i] = v;
+                else if (size == 2)
+                    reinterpret_cast<uint16_t*>(planes.data[q].data())[i] = static_cast<uint16_t>(v * maxv + 0.5f);
+                else
+                    planes.data[q][i] = static_cast<uint8_t>(v * maxv + 0.5f);
+            }
+        }
+    }
+}
+
+static bool read_frame(std::ifstream& ifs, Planes& planes, const int w, const int size, const int yuv)
+{
+    for (int q = 0; q < 3; ++q)
+    {
+        const int sub = (yuv == 2 && q > 0) ? 2 : 1;
+
+        for (int y = 0; y < planes.rows[q]; ++y)
+        {
+            if (!ifs.read(reinterpret_cast<char*>(planes.data[q].data() + y * planes.stride[q] * size), static_cast<std::streamsize>(w / sub) * size))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static double percentile(const std::vector<double>& sorted, const double p)
+{
+    return sorted[static_cast<size_t>(p * (sorted.size() - 1) + 0.5)];
+}
+
+static int run(const Options& o, const int gpuId, const int model, const int noise, const int scale, std::pair<int, int> tile, const int tta, const int stackTta, const int fp32,
+    const int threads, const std::vector<Planes>& sources)
+{
+    if (noise == -1 && scale == 1)
+        return 0;
+    if (model != 2 && scale == 1)
+        return 0;
+    if (gpuId == -1 && scale > 2)
+        return 0;
+
+    std::filesystem::path modelDir = o.models;
+    int prepadding = 0;
+
+    switch (model)
+    {
+        case 0:
+            modelDir /= "models-upconv_7_anime_style_art_rgb";
+            prepadding = 7;
+            break;
+        case 1:
+            modelDir /= "models-upconv_7_photo";
+            prepadding = 7;
+            break;
+        default:
+            modelDir /= "models-cunet";
+            prepadding = (noise == -1 || scale >= 2) ? 18 : 28;
+            break;
+    }
+
+    const std::string name = (noise == -1) ? "scale2.0x_model" : (scale == 1) ? "noise" + std::to_string(noise) + "_model" : "noise" + std::to_string(noise) + "_scale2.0x_model";
+    const std::filesystem::path paramPath = modelDir / (name + ".param");
+    const std::filesystem::path modelPath = modelDir / (name + ".bin");
+
+    if (!std::filesystem::exists(paramPath) && !std::filesystem::exists(modelDir / (name + ".param.bin")))
+    {
+        std::fprintf(stderr, "missing %s\n", paramPath.string().c_str());
+        return 1;
+    }
+
+    const int w = o.width;
+    const int h = o.height;
+
+    Waifu2x waifu2x(gpuId, tta, o.cpuThreads);
+    waifu2x.bits = o.bits;
+    waifu2x.yuv = o.yuv;
+    waifu2x.stack_tta = stackTta;
+    waifu2x.scale = scale;
+    waifu2x.whole_frame = o.wholeFrame;
+    waifu2x.map_model = o.mmap;
+
+    const auto loadStart = std::chrono::steady_clock::now();
+    waifu2x.load(paramPath.native(), modelPath.native(), fp32);
+    const double loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count();
+
+    waifu2x.noise = noise;
+    waifu2x.prepadding = prepadding;
+    waifu2x.tile_w = (tile.first < 0) ? (std::max)(w, 32) : tile.first;
+    waifu2x.tile_h = (tile.second < 0) ? (std::max)(h, 32) : tile.second;
+
+    if (waifu2x.tile_w == 0 || waifu2x.tile_h == 0)
+    {
+        const size_t budget = (gpuId == -1) ? SIZE_MAX : static_cast<size_t>(ncnn::get_gpu_device(gpuId)->get_heap_budget()) << 20;
+        waifu2x.autotune(w, h, threads, budget, waifu2x.tile_w == 0, waifu2x.tile_h == 0);
+    }
+
+    waifu2x.align_tiles();
+
+    // one set of output planes per thread
+    const int size = (o.bits == 32) ? 4 : (o.bits > 8) ? 2 : 1;
+    std::vector<std::vector<Planes>> outputs(threads, std::vector<Planes>(o.batch));
+    for (auto& thread_outputs : outputs)
+        for (auto& planes : thread_outputs)
+            create_planes(planes, w * scale, h * scale, size, o.yuv);
+
+    const int calls = (o.frames + o.batch - 1) / o.batch;
+    const int warmupCalls = (o.warmup + o.batch - 1) / o.batch;
+
+    std::atomic<int> next{ 0 };
+    std::mutex mutex;
+    std::vector<double> latencies;
+
+    const auto worker = [&](const int t)
+    {
+        std::vector<Waifu2x::Frame> frames(o.batch);
+
+        while (true)
+        {
+            const int call = next++;
+            if (call >= warmupCalls + calls)
+                break;
+
+            for (int i = 0; i < o.batch; ++i)
+            {
+                const Planes& src = sources[(call * o.batch + i) % sources.size()];
+                Planes& dst = outputs[t][i];
+
+                for (int q = 0; q < 3; ++q)
+                {
+                    frames[i].src[q] = src.data[q].data();
+                    frames[i].dst[q] = dst.data[q].data();
+                    frames[i].srcStride[q] = src.stride[q];
+                    frames[i].dstStride[q] = dst.stride[q];
+                }
+            }
+
+            const auto start = std::chrono::steady_clock::now();
+            waifu2x.process(frames.data(), o.batch, w, h);
+            const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+            if (call >= warmupCalls)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                latencies.emplace_back(ms / o.batch);
+            }
+        }
+    };
+
+    // the first calls are not measured, they create the allocations and the pipelines
+    const auto start = std::chrono::steady_clock::now();
+    {
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; ++t)
+            pool.emplace_back(worker, t);
+        for (auto& thread : pool)
+            thread.join();
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::sort(latencies.begin(), latencies.end());
+
+    double sum = 0.0;
+    for (const double l : latencies)
+        sum += l;
+
+    // the warm-up calls are part of the wall time, scale it to the measured frames
+    const double measuredSeconds = seconds * calls / (warmupCalls + calls);
+    const double fps = calls * o.batch / measuredSeconds;
+    const double vram = (gpuId == -1) ? 0.0 : waifu2x.tile_memory(waifu2x.tile_w, waifu2x.tile_h) * threads / 1048576.0;
+    const double peakVram = waifu2x.peak_memory() / 1048576.0;
+    const double rss = peak_host_memory() / 1048576.0;
+
+    if (o.csv)
+    {
+        std::printf("%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.1f,%.1f,%.1f,%.1f\n", gpuId, model, noise, scale, waifu2x.tile_w, waifu2x.tile_h, tta, stackTta, fp32, threads,
+            fps, sum / latencies.size(), percentile(latencies, 0.5), percentile(latencies, 0.9), percentile(latencies, 0.99), latencies.back(), loadMs, rss, vram, peakVram);
+    }
+    else
+    {
+        std::printf("model %d noise %2d scale %d tile %4dx%-4d tta %d stack %d fp32 %d threads %d | %7.2f fps | ms/frame mean %8.2f p50 %8.2f p90 %8.2f p99 %8.2f max %8.2f | load %7.1f ms | peak RSS %7.1f MiB | est. VRAM %7.1f MiB | peak VRAM %7.1f MiB\n",
+            model, noise, scale, waifu2x.tile_w, waifu2x.tile_h, tta, stackTta, fp32, threads,
+            fps, sum / latencies.size(), percentile(latencies, 0.5), percentile(latencies, 0.9), percentile(latencies, 0.99), latencies.back(), loadMs, rss, vram, peakVram);
+    }
+
+    std::fflush(stdout);
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    Options o;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        const char* value = (i + 1 < argc) ? argv[i + 1] : "";
+
+        if (arg == "--csv")
+        {
+            o.csv = true;
+            continue;
+        }
+
+        if (i + 1 >= argc)
+        {
+            std::fprintf(stderr, "missing value of %s\n", arg.c_str());
+            return 1;
+        }
+
+        ++i;
+
+        if (arg == "--models")
+            o.models = value;
+        else if (arg == "--gpu")
+            o.gpu = std::atoi(value);
+        else if (arg == "--model")
+            o.model = parse_list(value);
+        else if (arg == "--noise")
+            o.noise = parse_list(value);
+        else if (arg == "--scale")
+            o.scale = parse_list(value);
+        else if (arg == "--tile")
+        {
+            o.tile.clear();
+
+            for (const char* p = value; *p;)
+            {
+                const char* comma = std::strchr(p, ',');
+                const std::string item = comma ? std::string(p, comma) : std::string(p);
+
+                o.tile.emplace_back(parse_size(item.c_str()));
+                p = comma ? comma + 1 : p + item.size();
+            }
+        }
+        else if (arg == "--tta")
+            o.tta = parse_list(value);
+        else if (arg == "--stack-tta")
+            o.stackTta = parse_list(value);
+        else if (arg == "--fp32")
+            o.fp32 = parse_list(value);
+        else if (arg == "--threads")
+            o.threads = parse_list(value);
+        else if (arg == "--cpu-threads")
+            o.cpuThreads = std::atoi(value);
+        else if (arg == "--batch")
+            o.batch = (std::max)(std::atoi(value), 1);
+        else if (arg == "--whole-frame")
+            o.wholeFrame = std::atoi(value) != 0;
+        else if (arg == "--mmap")
+            o.mmap = std::atoi(value) != 0;
+        else if (arg == "--size")
+            std::tie(o.width, o.height) = parse_size(value);
+        else if (arg == "--bits")
+            o.bits = std::atoi(value);
+        else if (arg == "--yuv")
+            o.yuv = std::atoi(value);
+        else if (arg == "--input")
+            o.input = value;
+        else if (arg == "--frames")
+            o.frames = (std::max)(std::atoi(value), 1);
+        else if (arg == "--warmup")
+            o.warmup = (std::max)(std::atoi(value), 0);
+        else
+        {
+            std::fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    if (o.width < 1 || o.height < 1 || (o.yuv == 2 && (o.width % 2 || o.height % 2)))
+    {
+        std::fprintf(stderr, "invalid frame size\n");
+        return 1;
+    }
+    if (o.bits != 32 && (o.bits < 8 || o.bits > 16))
+    {
+        std::fprintf(stderr, "bits must be 8..16 or 32\n");
+        return 1;
+    }
+
+    // the GPU instance is only created when it can be used, a software Vulkan ICD counts as a GPU
+    bool gpuInstance = false;
+    int gpuId = o.gpu;
+
+    if (gpuId != -1)
+    {
+        if (ncnn::create_gpu_instance() == 0 && ncnn::get_gpu_count() > 0)
+        {
+            gpuInstance = true;
+
+            if (gpuId == -2)
+                gpuId = ncnn::get_default_gpu_index();
+            if (gpuId >= ncnn::get_gpu_count())
+            {
+                std::fprintf(stderr, "invalid GPU device\n");
+                return 1;
+            }
+
+            std::fprintf(stderr, "device %d: %s\n", gpuId, ncnn::get_gpu_info(gpuId).device_name());
+        }
+        else if (gpuId == -2)
+            gpuId = -1;
+        else
+        {
+            std::fprintf(stderr, "failed to create GPU instance\n");
+            return 1;
+        }
+    }
+
+    if (gpuId == -1)
+        std::fprintf(stderr, "device: CPU, %d threads\n", o.cpuThreads);
+
+    // a few source frames, so that the caches don't see the same frame every time
+    const int size = (o.bits == 32) ? 4 : (o.bits > 8) ? 2 : 1;
+    std::vector<Planes> sources;
+
+    if (!o.input.empty())
+    {
+        std::ifstream ifs(o.input, std::ios::binary);
+        if (!ifs)
+        {
+            std::fprintf(stderr, "failed to open %s\n", o.input.c_str());
+            return 1;
+        }
+
+        for (int i = 0; i < (std::max)(o.frames, 1); ++i)
+        {
+            Planes planes;
+            create_planes(planes, o.width, o.height, size, o.yuv);
+
+            if (!read_frame(ifs, planes, o.width, size, o.yuv))
+                break;
+
+            sources.emplace_back(std::move(planes));
+        }
+
+        if (sources.empty())
+        {
+            std::fprintf(stderr, "%s holds no complete frame\n", o.input.c_str());
+            return 1;
+        }
+    }
+    else
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            Planes planes;
+            create_planes(planes, o.width, o.height, size, o.yuv);
+            fill_synthetic(planes, o.width, o.height, o.bits, o.yuv, i);
+
+            sources.emplace_back(std::move(planes));
+        }
+    }
+
+    if (o.csv)
+        std::printf("gpu,model,noise,scale,tile_w,tile_h,tta,stack_tta,fp32,threads,fps,mean_ms,p50_ms,p90_ms,p99_ms,max_ms,load_ms,peak_rss_mib,est_vram_mib,peak_vram_mib\n");
+
+    int ret = 0;
+
+    for (const int model : o.model)
+        for (const int noise : o.noise)
+            for (const int scale : o.scale)
+                for (const auto& tile : o.tile)
+                    for (const int tta : o.tta)
+                        for (const int stackTta : o.stackTta)
+                            for (const int fp32 : o.fp32)
+                                for (const int threads : o.threads)
+                                    ret |= run(o, gpuId, model, noise, scale, tile, tta, stackTta, fp32, (std::max)(threads, 1), sources);
+
+    if (gpuInstance)
+        ncnn::destroy_gpu_instance();
+
+    return ret;
+}
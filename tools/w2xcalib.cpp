@@ -0,0 +1,598 @@
+// int8 calibration of the waifu2x models for the CPU backend (int8=true of the plugin)
+// build: g++ -O2 -std=c++20 -fopenmp -I../src -I<ncnn include> -I<ncnn source>/src -I<ncnn build>/src w2xcalib.cpp ../src/waifu2x.cpp ../src/fp16.cpp -lncnn -lvulkan -lglslang -lSPIRV ...
+//        the ncnn source and build folders are needed for the Convolution and InnerProduct layer headers, like ncnn's own tools/quantize
+//
+// w2xcalib [options]
+//   --models <dir>       folder with the models-* folders (default: models)
+//   --model <list>       0: upconv_7_anime_style_art_rgb, 1: upconv_7_photo, 2: cunet (default: 2)
+//   --noise <list>       -1..3 (default: 0)
+//   --scale <list>       1 or 2 (default: 2)
+//   --input <path>       a file or a folder of files of raw planar RGB frames of the given size, the sample frames (required)
+//   --size <WxH>         frame size (default: 640x360)
+//   --bits <n>           8..16 or 32 (default: 8)
+//   --tile <n>           tile size the samples are cut into (default: 128)
+//   --samples <n>        most tiles run through a model (default: 200)
+//   --percentile <p>     the activations are clipped at this percentile of their magnitude, 100 is the maximum (default: 99.99)
+//   --cpu-threads <n>    threads (default: number of logical processors)
+//   --compare            don't calibrate, compare the int8 models with the float ones on the sample frames (PSNR and speed)
+//
+// lists are comma separated, every combination is run
+//
+// calibration writes <name>.table next to every model, the quantized model is made with ncnn2int8 from ncnn's tools:
+//   ncnn2int8 <name>.param <name>.bin <name>.int8.param <name>.int8.bin <name>.table
+// the command lines are printed
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+// ncnn
+#include "ncnn/net.h"
+#include "layer/convolution.h"
+#include "layer/innerproduct.h"
+
+#include "waifu2x.h"
+
+struct Options
+{
+    std::filesystem::path models{ "models" };
+    std::vector<int> model{ 2 };
+    std::vector<int> noise{ 0 };
+    std::vector<int> scale{ 2 };
+    std::filesystem::path input;
+    int width{ 640 };
+    int height{ 360 };
+    int bits{ 8 };
+    int tile{ 128 };
+    int samples{ 200 };
+    double percentile{ 99.99 };
+    int cpuThreads{ static_cast<int>((std::max)(std::thread::hardware_concurrency(), 1u)) };
+    bool compare{ false };
+};
+
+// a sample frame as normalized float planes
+struct Frame
+{
+    std::vector<float> planes[3];
+};
+
+static std::vector<int> parse_list(const char* s)
+{
+    std::vector<int> list;
+
+    for (const char* p = s; *p;)
+    {
+        char* end;
+        list.emplace_back(static_cast<int>(std::strtol(p, &end, 10)));
+        p = (*end == ',') ? end + 1 : end;
+
+        if (end == p && *p)
+            break;
+    }
+
+    return list;
+}
+
+static std::pair<int, int> parse_size(const char* s)
+{
+    char* end;
+    const int w = static_cast<int>(std::strtol(s, &end, 10));
+    const int h = (*end == 'x') ? static_cast<int>(std::strtol(end + 1, nullptr, 10)) : w;
+
+    return { w, h };
+}
+
+// every complete frame of the file, converted to float
+static void read_frames(const std::filesystem::path& path, const Options& o, std::vector<Frame>& frames)
+{
+    const int size = (o.bits == 32) ? 4 : (o.bits > 8) ? 2 : 1;
+    const float maxv = (o.bits == 32) ? 1.f : static_cast<float>((1 << o.bits) - 1);
+    const size_t n = static_cast<size_t>(o.width) * o.height;
+
+    std::ifstream ifs(path, std::ios::binary);
+    std::vector<uint8_t> buffer(n * size);
+
+    while (true)
+    {
+        Frame frame;
+
+        for (int q = 0; q < 3; ++q)
+        {
+            if (!ifs.read(reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(buffer.size())))
+                return;
+
+            frame.planes[q].resize(n);
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (size == 4)
+                    std::memcpy(&frame.planes[q][i], &buffer[i * 4], 4);
+                else if (size == 2)
+                    frame.planes[q][i] = (buffer[i * 2] | (buffer[i * 2 + 1] << 8)) / maxv;
+                else
+                    frame.planes[q][i] = buffer[i] / maxv;
+            }
+        }
+
+        frames.emplace_back(std::move(frame));
+    }
+}
+
+// the model files and the prepadding of a combination, like the plugin picks them
+static bool model_path(const Options& o, const int model, const int noise, const int scale, std::filesystem::path& base, int& prepadding)
+{
+    if (noise == -1 && scale == 1)
+        return false;
+    if (model != 2 && scale == 1)
+        return false;
+
+    std::filesystem::path modelDir = o.models;
+
+    switch (model)
+    {
+        case 0:
+            modelDir /= "models-upconv_7_anime_style_art_rgb";
+            prepadding = 7;
+            break;
+        case 1:
+            modelDir /= "models-upconv_7_photo";
+            prepadding = 7;
+            break;
+        default:
+            modelDir /= "models-cunet";
+            prepadding = (noise == -1 || scale >= 2) ? 18 : 28;
+            break;
+    }
+
+    const std::string name = (noise == -1) ? "scale2.0x_model" : (scale == 1) ? "noise" + std::to_string(noise) + "_model" : "noise" + std::to_string(noise) + "_scale2.0x_model";
+    base = modelDir / name;
+
+    return true;
+}
+
+static std::filesystem::path with_extension(const std::filesystem::path& base, const char* extension)
+{
+    return base.parent_path() / (base.filename().string() + extension);
+}
+
+// the tiles of the frames with their prepadding, clamped at the frame edges like the preproc shader does
+static std::vector<ncnn::Mat> cut_tiles(const Options& o, const std::vector<Frame>& frames, const int prepadding)
+{
+    std::vector<ncnn::Mat> tiles;
+
+    const int xtiles = (std::max)(o.width / o.tile, 1);
+    const int ytiles = (std::max)(o.height / o.tile, 1);
+    const int total = static_cast<int>(frames.size()) * xtiles * ytiles;
+
+    // spread over all the frames when there are more tiles than samples
+    const int step = (std::max)(total / (std::max)(o.samples, 1), 1);
+
+    for (int i = 0; i < total && static_cast<int>(tiles.size()) < o.samples; i += step)
+    {
+        const Frame& frame = frames[i / (xtiles * ytiles)];
+        const int x0 = (i % xtiles) * o.tile - prepadding;
+        const int y0 = (i / xtiles % ytiles) * o.tile - prepadding;
+        const int size = o.tile + prepadding * 2;
+
+        ncnn::Mat tile(size, size, 3);
+
+        for (int q = 0; q < 3; ++q)
+        {
+            float* out = tile.channel(q);
+
+            for (int y = 0; y < size; ++y)
+            {
+                const int sy = (std::min)((std::max)(y0 + y, 0), o.height - 1);
+
+                for (int x = 0; x < size; ++x)
+                {
+                    const int sx = (std::min)((std::max)(x0 + x, 0), o.width - 1);
+                    out[y * size + x] = frame.planes[q][static_cast<size_t>(sy) * o.width + sx];
+                }
+            }
+        }
+
+        tiles.emplace_back(std::move(tile));
+    }
+
+    return tiles;
+}
+
+// a layer ncnn2int8 quantizes and its input blob
+struct Quantized
+{
+    const ncnn::Layer* layer;
+    std::string bottom;
+    float absmax;
+    std::vector<double> histogram;
+};
+
+static constexpr int histogram_bins = 2048;
+
+static int calibrate(const Options& o, const int model, const int noise, const int scale, const std::vector<Frame>& frames)
+{
+    std::filesystem::path base;
+    int prepadding = 0;
+
+    if (!model_path(o, model, noise, scale, base, prepadding))
+        return 0;
+
+    const std::filesystem::path paramPath = with_extension(base, ".param");
+    const std::filesystem::path modelPath = with_extension(base, ".bin");
+    const std::filesystem::path tablePath = with_extension(base, ".table");
+
+    if (!std::filesystem::exists(paramPath))
+    {
+        std::fprintf(stderr, "missing %s\n", paramPath.string().c_str());
+        return 1;
+    }
+
+    // float inference, the weights are kept after the pipelines are created (lightmode releases them)
+    ncnn::Net net;
+    net.opt.num_threads = o.cpuThreads;
+    net.opt.use_vulkan_compute = false;
+    net.opt.use_fp16_packed = false;
+    net.opt.use_fp16_storage = false;
+    net.opt.use_fp16_arithmetic = false;
+    net.opt.use_int8_inference = false;
+    net.opt.lightmode = false;
+
+    if (net.load_param(paramPath.string().c_str()) || net.load_model(modelPath.string().c_str()))
+    {
+        std::fprintf(stderr, "failed to load %s\n", paramPath.string().c_str());
+        return 1;
+    }
+
+    std::vector<Quantized> layers;
+
+    for (const ncnn::Layer* layer : net.layers())
+    {
+        if (layer->type == "Convolution" || layer->type == "InnerProduct")
+            layers.push_back(Quantized{ layer, net.blobs()[layer->bottoms[0]].name, 0.f, std::vector<double>(histogram_bins) });
+    }
+
+    const std::vector<ncnn::Mat> tiles = cut_tiles(o, frames, prepadding);
+
+    // two passes over the samples, the range of every input blob and then the histogram of its magnitudes in that range
+    const auto start = std::chrono::steady_clock::now();
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        for (const ncnn::Mat& tile : tiles)
+        {
+            ncnn::Extractor ex = net.create_extractor();
+            ex.set_light_mode(false);
+            ex.input("Input1", tile);
+
+            for (Quantized& q : layers)
+            {
+                ncnn::Mat blob;
+                ex.extract(q.bottom.c_str(), blob);
+
+                for (int c = 0; c < blob.c; ++c)
+                {
+                    const float* p = blob.channel(c);
+                    const int n = blob.w * blob.h;
+
+                    for (int i = 0; i < n; ++i)
+                    {
+                        // zeros are mostly the ReLU of the previous layer, they don't tell anything about the range
+                        const float v = std::fabs(p[i]);
+                        if (v == 0.f)
+                            continue;
+
+                        if (pass == 0)
+                            q.absmax = (std::max)(q.absmax, v);
+                        else
+                            q.histogram[(std::min)(static_cast<int>(v / q.absmax * histogram_bins), histogram_bins - 1)] += 1.0;
+                    }
+                }
+            }
+        }
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // ncnn's table format: the per output channel weight scales as <layer>_param_0, then the scale of the input blob of every layer
+    std::ofstream table(tablePath);
+
+    for (const Quantized& q : layers)
+    {
+        const ncnn::Mat* weight_data = nullptr;
+        int num_output = 0;
+
+        if (const auto* convolution = dynamic_cast<const ncnn::Convolution*>(q.layer))
+        {
+            weight_data = &convolution->weight_data;
+            num_output = convolution->num_output;
+        }
+        else if (const auto* innerproduct = dynamic_cast<const ncnn::InnerProduct*>(q.layer))
+        {
+            weight_data = &innerproduct->weight_data;
+            num_output = innerproduct->num_output;
+        }
+
+        if (!weight_data || weight_data->empty() || num_output == 0)
+        {
+            std::fprintf(stderr, "%s: no weights of %s\n", paramPath.string().c_str(), q.layer->name.c_str());
+            return 1;
+        }
+
+        const int n = static_cast<int>(weight_data->total()) / num_output;
+        const float* weights = *weight_data;
+
+        table << q.layer->name << "_param_0";
+
+        for (int i = 0; i < num_output; ++i)
+        {
+            float absmax = 0.f;
+            for (int k = 0; k < n; ++k)
+                absmax = (std::max)(absmax, std::fabs(weights[i * n + k]));
+
+            table << " " << ((absmax == 0.f) ? 1.f : 127.f / absmax);
+        }
+
+        table << "\n";
+    }
+
+    for (const Quantized& q : layers)
+    {
+        double count = 0.0;
+        for (const double bin : q.histogram)
+            count += bin;
+
+        // the magnitude below which the given share of the values lies
+        float threshold = q.absmax;
+        double sum = 0.0;
+
+        for (int i = 0; i < histogram_bins && count > 0.0; ++i)
+        {
+            sum += q.histogram[i];
+
+            if (sum >= count * o.percentile / 100.0)
+            {
+                threshold = q.absmax * (i + 1) / histogram_bins;
+                break;
+            }
+        }
+
+        table << q.layer->name << " " << ((threshold > 0.f) ? 127.f / threshold : 1.f) << "\n";
+    }
+
+    if (!table)
+    {
+        std::fprintf(stderr, "failed to write %s\n", tablePath.string().c_str());
+        return 1;
+    }
+
+    std::printf("%s: %d layers, %d tiles, %.1f s\n", tablePath.string().c_str(), static_cast<int>(layers.size()), static_cast<int>(tiles.size()), seconds);
+    std::printf("  ncnn2int8 %s %s %s %s %s\n", paramPath.string().c_str(), modelPath.string().c_str(), with_extension(base, ".int8.param").string().c_str(),
+        with_extension(base, ".int8.bin").string().c_str(), tablePath.string().c_str());
+    std::fflush(stdout);
+
+    return 0;
+}
+
+// upscales the sample frames with the float and the int8 model on the CPU backend, the int8 output is compared with the float one
+static int compare(const Options& o, const int model, const int noise, const int scale, const std::vector<Frame>& frames)
+{
+    std::filesystem::path base;
+    int prepadding = 0;
+
+    if (!model_path(o, model, noise, scale, base, prepadding))
+        return 0;
+
+    if (!std::filesystem::exists(with_extension(base, ".int8.param")))
+    {
+        std::fprintf(stderr, "missing %s, calibrate and quantize the model first\n", with_extension(base, ".int8.param").string().c_str());
+        return 1;
+    }
+
+    const int w = o.width;
+    const int h = o.height;
+    const size_t out_size = static_cast<size_t>(w) * scale * h * scale;
+
+    // the outputs of every frame of the float model, then of the int8 one
+    std::vector<float> outputs[2];
+    double seconds[2] = {};
+
+    for (int int8 = 0; int8 < 2; ++int8)
+    {
+        Waifu2x waifu2x(-1, 1, o.cpuThreads);
+        waifu2x.scale = scale;
+        waifu2x.int8 = int8;
+        waifu2x.load(with_extension(base, int8 ? ".int8.param" : ".param").native(), with_extension(base, int8 ? ".int8.bin" : ".bin").native(), true);
+
+        waifu2x.noise = noise;
+        waifu2x.prepadding = prepadding;
+        waifu2x.tile_w = (std::max)(o.tile, 32);
+        waifu2x.tile_h = (std::max)(o.tile, 32);
+        waifu2x.align_tiles();
+
+        outputs[int8].resize(frames.size() * out_size * 3);
+
+        for (size_t f = 0; f < frames.size(); ++f)
+        {
+            Waifu2x::Frame frame{};
+
+            for (int q = 0; q < 3; ++q)
+            {
+                frame.src[q] = frames[f].planes[q].data();
+                frame.dst[q] = outputs[int8].data() + (f * 3 + q) * out_size;
+                frame.srcStride[q] = w;
+                frame.dstStride[q] = static_cast<ptrdiff_t>(w) * scale;
+            }
+
+            // the first frame creates the allocations, it isn't timed
+            const auto start = std::chrono::steady_clock::now();
+            if (waifu2x.process(&frame, 1, w, h) != 0)
+            {
+                std::fprintf(stderr, "processing failed\n");
+                return 1;
+            }
+            if (f > 0 || frames.size() == 1)
+                seconds[int8] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    // PSNR of every frame against the float output, the outputs are clipped to 0..1 like the plugin stores them
+    double sum = 0.0;
+    double worst = INFINITY;
+
+    for (size_t f = 0; f < frames.size(); ++f)
+    {
+        double mse = 0.0;
+
+        for (size_t i = f * out_size * 3; i < (f + 1) * out_size * 3; ++i)
+        {
+            const double d = std::clamp(outputs[0][i], 0.f, 1.f) - std::clamp(outputs[1][i], 0.f, 1.f);
+            mse += d * d;
+        }
+
+        mse /= out_size * 3;
+
+        const double psnr = (mse > 0.0) ? 10.0 * std::log10(1.0 / mse) : 100.0;
+        sum += psnr;
+        worst = (std::min)(worst, psnr);
+    }
+
+    const int timed = (frames.size() > 1) ? static_cast<int>(frames.size()) - 1 : 1;
+
+    std::printf("model %d noise %2d scale %d | float %7.2f fps | int8 %7.2f fps (x%.2f) | PSNR mean %6.2f dB min %6.2f dB\n", model, noise, scale,
+        timed / seconds[0], timed / seconds[1], seconds[0] / seconds[1], sum / frames.size(), worst);
+    std::fflush(stdout);
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    Options o;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        const char* value = (i + 1 < argc) ? argv[i + 1] : "";
+
+        if (arg == "--compare")
+        {
+            o.compare = true;
+            continue;
+        }
+
+        if (i + 1 >= argc)
+        {
+            std::fprintf(stderr, "missing value of %s\n", arg.c_str());
+            return 1;
+        }
+
+        ++i;
+
+        if (arg == "--models")
+            o.models = value;
+        else if (arg == "--model")
+            o.model = parse_list(value);
+        else if (arg == "--noise")
+            o.noise = parse_list(value);
+        else if (arg == "--scale")
+            o.scale = parse_list(value);
+        else if (arg == "--input")
+            o.input = value;
+        else if (arg == "--size")
+            std::tie(o.width, o.height) = parse_size(value);
+        else if (arg == "--bits")
+            o.bits = std::atoi(value);
+        else if (arg == "--tile")
+            o.tile = std::atoi(value);
+        else if (arg == "--samples")
+            o.samples = (std::max)(std::atoi(value), 1);
+        else if (arg == "--percentile")
+            o.percentile = std::atof(value);
+        else if (arg == "--cpu-threads")
+            o.cpuThreads = (std::max)(std::atoi(value), 1);
+        else
+        {
+            std::fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    if (o.input.empty())
+    {
+        std::fprintf(stderr, "--input is required\n");
+        return 1;
+    }
+    if (o.width < 1 || o.height < 1)
+    {
+        std::fprintf(stderr, "invalid frame size\n");
+        return 1;
+    }
+    if (o.bits != 32 && (o.bits < 8 || o.bits > 16))
+    {
+        std::fprintf(stderr, "bits must be 8..16 or 32\n");
+        return 1;
+    }
+    if (o.tile < 32 || o.tile % 4)
+    {
+        std::fprintf(stderr, "tile must be a multiple of 4 and at least 32\n");
+        return 1;
+    }
+    if (o.percentile <= 0.0 || o.percentile > 100.0)
+    {
+        std::fprintf(stderr, "percentile must be greater than 0 and at most 100\n");
+        return 1;
+    }
+
+    std::vector<Frame> frames;
+
+    if (std::filesystem::is_directory(o.input))
+    {
+        std::vector<std::filesystem::path> files;
+        for (const auto& entry : std::filesystem::directory_iterator(o.input))
+            if (entry.is_regular_file())
+                files.emplace_back(entry.path());
+
+        std::sort(files.begin(), files.end());
+
+        for (const auto& file : files)
+            read_frames(file, o, frames);
+    }
+    else
+    {
+        read_frames(o.input, o, frames);
+    }
+
+    if (frames.empty())
+    {
+        std::fprintf(stderr, "%s holds no complete frame\n", o.input.string().c_str());
+        return 1;
+    }
+
+    std::fprintf(stderr, "%d sample frames, CPU, %d threads\n", static_cast<int>(frames.size()), o.cpuThreads);
+
+    int ret = 0;
+
+    for (const int model : o.model)
+        for (const int noise : o.noise)
+            for (const int scale : o.scale)
+            {
+                if (scale != 1 && scale != 2)
+                {
+                    std::fprintf(stderr, "scale must be 1 or 2\n");
+                    return 1;
+                }
+
+                ret |= o.compare ? compare(o, model, noise, scale, frames) : calibrate(o, model, noise, scale, frames);
+            }
+
+    return ret;
+}